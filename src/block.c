@@ -16,7 +16,8 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
+#include <pthread.h>
 
 /*
  * Here is the convention I used for the cube vertices, edges and faces:
@@ -49,11 +50,6 @@ static const int N = BLOCK_SIZE;
         for (y = 0; y < N; y++) \
             for (x = 0; x < N; x++)
 
-#define BLOCK_ITER_INSIDE(x, y, z) \
-    for (z = 1; z < N - 1; z++) \
-        for (y = 1; y < N - 1; y++) \
-            for (x = 1; x < N - 1; x++)
-
 #define DATA_AT(d, x, y, z) (d->voxels[x + y * N + z * N * N])
 #define BLOCK_AT(c, x, y, z) (DATA_AT(c->data, x, y, z))
 
@@ -121,21 +117,41 @@ const int EDGES_VERTICES[12][2] = {
     {0, 4}, {1, 5}, {2, 6}, {3, 7},
 };
 
-static int make_id(void)
+static uint64_t make_id(void)
+{
+    return __atomic_add_fetch(&core()->block_next_id, 1, __ATOMIC_RELAXED);
+}
+
+static block_data_t *g_empty_data = NULL;
+
+static void init_empty_data(void)
 {
-    return ++goxel()->block_next_id;
+    g_empty_data = calloc(1, sizeof(*g_empty_data));
+    g_empty_data->ref = 1;
+    g_empty_data->id = 0;
+    __atomic_add_fetch(&core()->block_count, 1, __ATOMIC_RELAXED);
 }
 
 static block_data_t *get_empty_data(void)
 {
-    static block_data_t *data = NULL;
-    if (!data) {
-        data = calloc(1, sizeof(*data));
-        data->ref = 1;
-        data->id = 0;
-        goxel()->block_count++;
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_empty_data);
+    return g_empty_data;
+}
+
+// The blocks data can be shared by images living in different threads (at
+// least the empty data), so the references count is atomic.
+static void data_ref(block_data_t *data)
+{
+    __atomic_add_fetch(&data->ref, 1, __ATOMIC_RELAXED);
+}
+
+static void data_unref(block_data_t *data)
+{
+    if (__atomic_sub_fetch(&data->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(data);
+        __atomic_sub_fetch(&core()->block_count, 1, __ATOMIC_RELAXED);
     }
-    return data;
 }
 
 bool block_is_empty(const block_t *block, bool fast)
@@ -156,17 +172,13 @@ block_t *block_new(const vec3_t *pos, block_data_t *data)
     block_t *block = calloc(1, sizeof(*block));
     block->pos = *pos;
     block->data = data ?: get_empty_data();
-    block->data->ref++;
+    data_ref(block->data);
     return block;
 }
 
 void block_delete(block_t *block)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-        goxel()->block_count--;
-    }
+    data_unref(block->data);
     free(block);
 }
 
@@ -175,19 +187,16 @@ block_t *block_copy(const block_t *other)
     block_t *block = malloc(sizeof(*block));
     *block = *other;
     block->next = block->prev = NULL;
-    block->data->ref++;
+    memset(&block->hh, 0, sizeof(block->hh));
+    data_ref(block->data);
     return block;
 }
 
 void block_set_data(block_t *block, block_data_t *data)
 {
-    block->data->ref--;
-    if (block->data->ref == 0) {
-        free(block->data);
-        goxel()->block_count--;
-    }
+    data_ref(data);
+    data_unref(block->data);
     block->data = data;
-    data->ref++;
 }
 
 box_t block_get_box(const block_t *block, bool exact)
@@ -215,7 +224,74 @@ box_t block_get_box(const block_t *block, bool exact)
     return ret;
 }
 
-static uint32_t block_get_neighboors(const block_data_t *data,
+// Size of the block alpha buffer with the one voxel shell of the neighbors.
+#define P (N + 2)
+
+// Fill out with the alpha of the block voxels, plus the shell of voxels
+// around it taken from the neighbor blocks.  The voxel (x, y, z) of the
+// block is at (x + 1, y + 1, z + 1).
+static void block_get_padded_alpha(const block_data_t *neighbors[27],
+                                   uint8_t out[P * P * P])
+{
+    int x, y, z, ly, lz, i;
+    uint8_t *row;
+    const block_data_t *data;
+#define NB(x) ((x) == 0 ? 0 : (x) == P - 1 ? 2 : 1)
+#define LOCAL(x) (((x) + N - 1) % N)
+    for (z = 0; z < P; z++)
+    for (y = 0; y < P; y++) {
+        row = &out[(y + z * P) * P];
+        i = NB(y) * 3 + NB(z) * 9;
+        ly = LOCAL(y);
+        lz = LOCAL(z);
+        data = neighbors[i];
+        row[0] = data ? DATA_AT(data, N - 1, ly, lz).a : 0;
+        data = neighbors[i + 2];
+        row[P - 1] = data ? DATA_AT(data, 0, ly, lz).a : 0;
+        data = neighbors[i + 1];
+        if (!data) {
+            memset(row + 1, 0, N);
+            continue;
+        }
+        for (x = 0; x < N; x++)
+            row[x + 1] = DATA_AT(data, x, ly, lz).a;
+    }
+#undef NB
+#undef LOCAL
+}
+
+// Same as block_get_padded_alpha, but with the full voxels values.
+void block_get_padded_voxels(const block_data_t *neighbors[27],
+                             uvec4b_t *out)
+{
+    int y, z, ly, lz, i;
+    uvec4b_t *row;
+    const block_data_t *data;
+    const uvec4b_t zero = uvec4b(0, 0, 0, 0);
+#define NB(x) ((x) == 0 ? 0 : (x) == P - 1 ? 2 : 1)
+#define LOCAL(x) (((x) + N - 1) % N)
+    for (z = 0; z < P; z++)
+    for (y = 0; y < P; y++) {
+        row = &out[(y + z * P) * P];
+        i = NB(y) * 3 + NB(z) * 9;
+        ly = LOCAL(y);
+        lz = LOCAL(z);
+        data = neighbors[i];
+        row[0] = data ? DATA_AT(data, N - 1, ly, lz) : zero;
+        data = neighbors[i + 2];
+        row[P - 1] = data ? DATA_AT(data, 0, ly, lz) : zero;
+        data = neighbors[i + 1];
+        if (!data) {
+            memset(row + 1, 0, N * sizeof(*row));
+            continue;
+        }
+        memcpy(row + 1, &DATA_AT(data, 0, ly, lz), N * sizeof(*row));
+    }
+#undef NB
+#undef LOCAL
+}
+
+static uint32_t block_get_neighboors(const uint8_t alpha[P * P * P],
                                     int x, int y, int z,
                                     uint8_t neighboors[27])
 {
@@ -227,8 +303,8 @@ static uint32_t block_get_neighboors(const block_data_t *data,
          for (y = -1; y <= 1; y++)       \
              for (x = -1; x <= 1; x++)
     ITER_NEIGHBORS(xx, yy, zz) {
-        npos = vec3b(x + xx, y + yy, z + zz);
-        neighboors[i] = DATA_AT(data, npos.x, npos.y, npos.z).a;
+        npos = vec3b(x + xx + 1, y + yy + 1, z + zz + 1);
+        neighboors[i] = alpha[npos.x + npos.y * P + npos.z * P * P];
         if (neighboors[i] >= 127) ret |= 1 << i;
         i++;
     }
@@ -377,7 +453,7 @@ static uvec2b_t get_pos_as_vec2(int x, int y, int z, int f)
                   z << 4 | f);
 }
 
-int block_generate_vertices(const block_data_t *data, int effects,
+int block_generate_vertices(const block_data_t *neighbors[27], int effects,
                             voxel_vertex_t *out)
 {
     PROFILED
@@ -387,10 +463,15 @@ int block_generate_vertices(const block_data_t *data, int effects,
     uint8_t shadow_mask, borders_mask;
     vec3b_t normal;
     const int ts = VOXEL_TEXTURE_SIZE;
+    const block_data_t *data = neighbors[13];
     uint8_t neighboors[27];
-    BLOCK_ITER_INSIDE(x, y, z) {
+    uint8_t alpha[P * P * P];
+
+    if (!data || data->id == 0) return 0;
+    block_get_padded_alpha(neighbors, alpha);
+    BLOCK_ITER(x, y, z) {
         if (DATA_AT(data, x, y, z).a < 127) continue;    // Non visible
-        neighboors_mask = block_get_neighboors(data, x, y, z, neighboors);
+        neighboors_mask = block_get_neighboors(alpha, x, y, z, neighboors);
         for (f = 0; f < 6; f++) {
             if (!block_is_face_visible(neighboors_mask, f)) continue;
             normal = block_get_normal(neighboors_mask, neighboors, f,
@@ -420,6 +501,8 @@ int block_generate_vertices(const block_data_t *data, int effects,
     return nb;
 }
 
+#undef P
+
 static vec3_t block_get_voxel_pos(const block_t *block, int x, int y, int z)
 {
     return vec3(block->pos.x + x - BLOCK_SIZE / 2 + 0.5,
@@ -428,19 +511,23 @@ static vec3_t block_get_voxel_pos(const block_t *block, int x, int y, int z)
 }
 
 // Copy the data if there are any other blocks having reference to it.
+// Otherwise the data is modified in place, and we give it a new id since
+// the ids are used as keys for the content (see render.c).  To call only
+// once per modification, not for each voxel.
 static void block_prepare_write(block_t *block)
 {
-    if (block->data->ref == 1) {
+    block_data_t *data;
+    if (__atomic_load_n(&block->data->ref, __ATOMIC_ACQUIRE) == 1) {
+        block->data->id = make_id();
         return;
     }
-    block->data->ref--;
-    block_data_t *data;
     data = calloc(1, sizeof(*block->data));
     memcpy(data->voxels, block->data->voxels, N * N * N * 4);
     data->ref = 1;
+    data->id = make_id();
+    __atomic_add_fetch(&core()->block_count, 1, __ATOMIC_RELAXED);
+    data_unref(block->data);
     block->data = data;
-    block->data->id = make_id();
-    goxel()->block_count++;
 }
 
 void block_fill(block_t *block,
@@ -483,6 +570,7 @@ void block_op(block_t *block, painter_t *painter, const box_t *box)
     mat4_t mat = mat4_identity;
     vec3_t p, size;
     uint8_t v;
+    bool written = false;
     float (*shape_func)(const vec3_t*, const vec3_t*) = painter->shape->func;
 
     size = box_get_size(*box);
@@ -497,7 +585,8 @@ void block_op(block_t *block, painter_t *painter, const box_t *box)
         p = mat4_mul_vec3(mat, vec3(x, y, z));
         v = shape_func(&p, &size) * 255;
         if (v) {
-            block_prepare_write(block);
+            if (!written) block_prepare_write(block);
+            written = true;
             apply_op(&BLOCK_AT(block, x, y, z), painter, v);
         }
     }
@@ -532,15 +621,27 @@ void block_merge(block_t *block, const block_t *other)
     }
 }
 
-uvec4b_t block_get_at(const block_t *block, const vec3_t *pos)
+static uvec4b_t *block_get_voxel(const block_t *block, const vec3_t *pos)
 {
     int x, y, z;
     vec3_t p = *pos;
     assert(bbox_contains_vec(block_get_box(block, false), *pos));
     vec3_isub(&p, block->pos);
     vec3_iadd(&p, vec3(N / 2 - 0.5, N / 2 - 0.5, N / 2 - 0.5));
-    x = nearbyint(p.x);
-    y = nearbyint(p.y);
-    z = nearbyint(p.z);
-    return BLOCK_AT(block, x, y, z);
+    x = clamp(nearbyint(p.x), 0, N - 1);
+    y = clamp(nearbyint(p.y), 0, N - 1);
+    z = clamp(nearbyint(p.z), 0, N - 1);
+    return &BLOCK_AT(block, x, y, z);
+}
+
+uvec4b_t block_get_at(const block_t *block, const vec3_t *pos)
+{
+    return *block_get_voxel(block, pos);
+}
+
+void block_set_at(block_t *block, const vec3_t *pos, uvec4b_t v)
+{
+    if (uvec4b_equal(*block_get_voxel(block, pos), v)) return;
+    block_prepare_write(block);
+    *block_get_voxel(block, pos) = v;
 }
@@ -19,7 +19,7 @@
 #ifndef _BOX_H_
 #define _BOX_H_
 
-#include "goxel.h"
+#include "core.h"
 
 // A Box is represented as the 4x4 matrix that transforms the unit cube into
 // the box.
@@ -16,7 +16,7 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
 
 static void hsl_to_rgb_f(const float hsl[3], float rgb[3])
 {
@@ -0,0 +1,131 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Command line batch conversion, without any window or GL context.
+ *
+ * Each file is loaded, its visible layers merged and exported by a worker
+ * thread, so several files are converted concurrently.  The images are
+ * independent from each other and from the editor image, the only shared
+ * state is the blocks data ids and references counts, that are atomic.
+ */
+
+#include "core.h"
+#include <pthread.h>
+
+typedef struct {
+    const char  **inputs;
+    const char  **outputs;
+    int         nb;
+    int         mode;
+    int         next;   // Next file to convert, updated atomically.
+    int         errors; // Updated atomically.
+} convert_t;
+
+static int export_obj(const mesh_t *mesh, const char *path, int mode)
+{
+    return wavefront_export(mesh, path, mode, false);
+}
+
+static int export_ply(const mesh_t *mesh, const char *path, int mode)
+{
+    return ply_export(mesh, path, false, mode);
+}
+
+// XXX: png export needs a GL context.
+static const struct {
+    const char *ext;
+    int (*func)(const mesh_t *mesh, const char *path, int mode);
+} FORMATS[] = {
+    {".obj", export_obj},
+    {".ply", export_ply},
+    {".stl", stl_export},
+    {".glb", gltf_export},
+};
+
+static int convert_file(const char *in, const char *out, int mode)
+{
+    image_t *img;
+    layer_t *layer;
+    mesh_t *mesh;
+    int i, ret;
+
+    for (i = 0; i < ARRAY_SIZE(FORMATS); i++)
+        if (str_endswith(out, FORMATS[i].ext)) break;
+    if (i == ARRAY_SIZE(FORMATS)) {
+        LOG_E("Unsupported output format: %s", out);
+        return -1;
+    }
+    img = load_image(in, core()->check_crc, NULL);
+    if (!img) return -1;
+    mesh = mesh_new();
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->visible) continue;
+        mesh_merge(mesh, layer->mesh);
+    }
+    ret = FORMATS[i].func(mesh, out, mode);
+    mesh_delete(mesh);
+    image_delete(img);
+    if (ret == 0) LOG_I("%s -> %s", in, out);
+    return ret;
+}
+
+static void *convert_worker(void *arg)
+{
+    convert_t *conv = arg;
+    int i;
+    while ((i = __atomic_fetch_add(&conv->next, 1, __ATOMIC_RELAXED))
+            < conv->nb) {
+        if (convert_file(conv->inputs[i], conv->outputs[i], conv->mode))
+            __atomic_add_fetch(&conv->errors, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+int goxel_convert(const char **inputs, const char **outputs, int nb,
+                  int nb_threads, int mode)
+{
+    convert_t conv = {
+        .inputs = inputs,
+        .outputs = outputs,
+        .nb = nb,
+        .mode = mode,
+    };
+    pthread_t threads[64];
+    int i, nb_files_threads;
+
+    if (nb_threads <= 0) nb_threads = sys_get_nb_cpus();
+    nb_threads = clamp(nb_threads, 1, ARRAY_SIZE(threads));
+    // With several files we convert them in parallel and each export runs
+    // on its own thread, otherwise all the threads go to the export.
+    nb_files_threads = min(nb_threads, nb);
+    core()->nb_threads = (nb > 1 || nb_threads == 1) ? -1 : nb_threads - 1;
+
+    // The current thread also converts files.
+    for (i = 0; i < nb_files_threads - 1; i++) {
+        if (pthread_create(&threads[i], NULL, convert_worker, &conv)) {
+            LOG_E("Cannot create convert thread");
+            break;
+        }
+    }
+    nb_files_threads = i;
+    convert_worker(&conv);
+    for (i = 0; i < nb_files_threads; i++)
+        pthread_join(threads[i], NULL);
+    return conv.errors ? -1 : 0;
+}
@@ -0,0 +1,35 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "core.h"
+
+static core_t *g_core = NULL;
+
+void core_init(core_t *core)
+{
+    g_core = core;
+    memset(core, 0, sizeof(*core));
+    shapes_init();
+    core->check_crc = true;
+    core->history_budget = 512 * (1 << 20);
+}
+
+core_t *core(void)
+{
+    return g_core;
+}
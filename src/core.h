@@ -0,0 +1,599 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The GL-free part of goxel: voxels storage, meshes operations, images,
+ * files and exporters.  It is built as the goxelcore static library, that
+ * doesn't depend on GL, GLFW or GTK, so that it can be used by headless
+ * tools.  The editor (goxel.h) builds on top of it.
+ */
+
+#ifndef _CORE_H_
+#define _CORE_H_
+
+#ifndef _GNU_SOURCE
+#   define _GNU_SOURCE
+#endif
+
+#ifndef NOMINMAX
+#   define NOMINMAX
+#endif
+
+#include "vec.h"
+#include "utlist.h"
+#include "uthash.h"
+#include "utarray.h"
+#include "ivec.h"
+#include <float.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#define GOXEL_VERSION_STR "0.1.0"
+
+// #### Set the DEBUG macro ####
+#ifndef DEBUG
+#   if !defined(NDEBUG)
+#       define DEBUG 1
+#   else
+#       define DEBUG 0
+#   endif
+#endif
+// #############################
+
+
+
+// #### DEFINED macro ##########
+// DEFINE(NAME) returns 1 if NAME is defined to 1, 0 otherwise.
+#define DEFINED(macro) DEFINED_(macro)
+#define macrotest_1 ,
+#define DEFINED_(value) DEFINED__(macrotest_##value)
+#define DEFINED__(comma) DEFINED___(comma 1, 0)
+#define DEFINED___(_, v, ...) v
+// #############################
+
+
+// #### Logging macros #########
+
+enum {
+    LOG_VERBOSE = 2,
+    LOG_DEBUG   = 3,
+    LOG_INFO    = 4,
+    LOG_WARN    = 5,
+    LOG_ERROR   = 6,
+};
+
+#ifndef LOG_LEVEL
+#   if DEBUG
+#       define LOG_LEVEL LOG_DEBUG
+#   else
+#       define LOG_LEVEL LOG_INFO
+#   endif
+#endif
+
+#define LOG(level, msg, ...) do { \
+    if (level >= LOG_LEVEL) \
+        dolog(level, msg, __func__, __FILE__, __LINE__, ##__VA_ARGS__); \
+} while(0)
+
+#define LOG_V(msg, ...) LOG(LOG_VERBOSE, msg, ##__VA_ARGS__)
+#define LOG_D(msg, ...) LOG(LOG_DEBUG,   msg, ##__VA_ARGS__)
+#define LOG_I(msg, ...) LOG(LOG_INFO,    msg, ##__VA_ARGS__)
+#define LOG_W(msg, ...) LOG(LOG_WARN,    msg, ##__VA_ARGS__)
+#define LOG_E(msg, ...) LOG(LOG_ERROR,   msg, ##__VA_ARGS__)
+// #############################
+
+
+
+// ### Some useful inline functions / macros.
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+#define SWAP(x0, x) {typeof(x0) tmp = x0; x0 = x; x = tmp;}
+
+static inline uvec4b_t HEXCOLOR(uint32_t v)
+{
+    return uvec4b((v >> 24) & 0xff,
+                  (v >> 16) & 0xff,
+                  (v >>  8) & 0xff,
+                  (v >>  0) & 0xff);
+}
+
+static inline vec4_t uvec4b_to_vec4(uvec4b_t v)
+{
+    return vec4(v.x / 255., v.y / 255., v.z / 255., v.w / 255.);
+}
+
+#define min(a, b) ({ \
+      __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a < _b ? _a : _b; \
+      })
+
+#define max(a, b) ({ \
+      __typeof__ (a) _a = (a); \
+      __typeof__ (b) _b = (b); \
+      _a > _b ? _a : _b; \
+      })
+
+#define clamp(x, a, b) (min(max(x, a), b))
+
+#define sign(x) ({ \
+      __typeof__ (x) _x = (x); \
+      (_x > 0) ? +1 : (_x < 0)? -1 : 0; \
+      })
+
+static inline float smoothstep(float edge0, float edge1, float x)
+{
+    x = clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
+    return x * x * (3.0f - 2.0f * x);
+}
+
+static inline float mix(float x, float y, float t)
+{
+    return (1.0 - t) * x + t * y;
+}
+
+// #############################
+
+// XXX: I should clean up a but the code of vec.h so that I can put those on
+// top.
+#include "box.h"
+#include "plane.h"
+
+
+// #### Utils ##################
+
+// Used internally by the LOG macro
+void dolog(int level, const char *msg,
+           const char *func, const char *file, int line, ...);
+unsigned int gox_rand(void);
+float gox_frand(float min, float max);
+uint8_t *img_read(const char *path, int *width, int *height, int *bpp);
+uint8_t *img_read_from_mem(const char *data, int size,
+                           int *w, int *h, int *bpp);
+void img_write(const uint8_t *img, int w, int h, int bpp, const char *path);
+uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp,
+                          int *size);
+bool str_endswith(const char *str, const char *end);
+double get_unix_time(void);
+void create_dirs(const char *path);
+void hash_128(const void *data, int len, uint64_t out[2]);
+uint32_t crc32c(uint32_t crc, const void *data, int len);
+
+// #############################
+
+
+
+// #### System #################
+void sys_log(const char *msg);
+const char *sys_get_data_dir(void);
+bool sys_asset_exists(const char *path);
+char *sys_read_asset(const char *path, int *size);
+int sys_get_nb_cpus(void);
+int sys_get_pid(void);
+// Open a file and take an exclusive lock on it, without waiting.  Return
+// NULL if another process holds the lock.  The lock is released when the
+// file is closed, or when the process ends.
+FILE *sys_lock_file(const char *path);
+// Call f with the name of each entry of a directory.  Return -1 if the
+// directory cannot be read.
+int sys_list_dir(const char *path,
+                 void (*f)(const char *name, void *user), void *user);
+// #############################
+
+
+// #### Core context ###########
+// Global state of the core library.  All the core functions use the
+// context set by core_init: the editor uses the one in goxel_t, the
+// headless tools can just declare one.
+typedef struct core
+{
+    uint64_t block_next_id; // Updated atomically.
+    uint64_t history_next_serial; // Updated atomically.
+    int     block_count;    // Counter for the number of block data.
+                            // Updated atomically.
+    bool    check_crc;      // Verify the chunks CRC when loading files.
+    int     nb_threads;     // Worker threads for the exports, 0 for auto,
+                            // negative for none.
+    long    history_budget; // Max bytes retained by the undo history, the
+                            // oldest entries are deleted past it.  0 for
+                            // no limit.
+    int     history_in_memory; // Undo steps kept in memory around the
+                               // current one, the others are moved to a
+                               // scratch file.  0 to keep them all.
+} core_t;
+
+// Initialize a context and make it the current one.
+void core_init(core_t *core);
+core_t *core(void);
+// #############################
+
+
+// #### Operation/Painter ######
+enum {
+    OP_NULL,
+    OP_ADD,
+    OP_SUB,
+    OP_PAINT,
+};
+
+typedef struct shape {
+    float (*func)(const vec3_t *p, const vec3_t *s);
+} shape_t;
+
+void shapes_init(void);
+extern shape_t shape_sphere;
+extern shape_t shape_cube;
+extern shape_t shape_cylinder;
+extern shape_t shape_capsule;
+
+
+// The painting context, including the tool, brush, operation, radius,
+// color, etc...
+typedef struct painter {
+    int         op;
+    shape_t     *shape;
+    uvec4b_t    color;
+} painter_t;
+// #############################
+
+// #### Block ##################
+// The block size can only be 16.  The blocks tile the space without
+// overlapping: their positions are multiple of BLOCK_SIZE, and the meshing
+// reads the border voxels of the neighbor blocks.
+#define BLOCK_SIZE 16
+#define VOXEL_TEXTURE_SIZE 8
+
+// Rendering effects, also used to generate the blocks vertices.
+enum {
+    EFFECT_RENDER_POS       = 1 << 1,
+    EFFECT_SMOOTH           = 1 << 2,
+    EFFECT_BORDERS          = 1 << 3,
+    EFFECT_BORDERS_ALL      = 1 << 4,
+    EFFECT_SEMI_TRANSPARENT = 1 << 5,
+    EFFECT_SEE_BACK         = 1 << 6,
+};
+
+// Structure used for the OpenGL array data of blocks.
+// XXX: we can probably make it smaller.
+typedef struct voxel_vertex
+{
+    vec3b_t  pos        __attribute__((aligned(4)));
+    vec3b_t  normal     __attribute__((aligned(4)));
+    uvec4b_t color      __attribute__((aligned(4)));
+    uvec2b_t pos_data   __attribute__((aligned(4)));
+    uvec2b_t bshadow_uv __attribute__((aligned(4)));
+    uvec2b_t bump_uv    __attribute__((aligned(4)));
+} voxel_vertex_t;
+
+// We use copy on write for the block data, so that it is cheap to copy
+// blocks.
+typedef struct block_data block_data_t;
+struct block_data
+{
+    int         ref;
+    uint64_t    id;         // Changes each time the voxels change.
+    uvec4b_t    voxels[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE]; // RGBA voxels.
+};
+
+typedef struct block block_t;
+struct block
+{
+    block_t         *next, *prev;   // All the blocks are in a list.
+    UT_hash_handle  hh;             // Mesh index, keyed on the position.
+    block_data_t    *data;
+    vec3_t          pos;
+    int             id;
+};
+block_t *block_new(const vec3_t *pos, block_data_t *data);
+void block_delete(block_t *block);
+block_t *block_copy(const block_t *other);
+void block_set_data(block_t *block, block_data_t *data);
+box_t block_get_box(const block_t *block, bool exact);
+void block_fill(block_t *block,
+                uvec4b_t (*get_color)(const vec3_t *pos, void *user_data),
+                void *user_data);
+// neighbors contains the data of the 3x3x3 blocks around the block (NULL
+// for no block), the block itself being at index 13.
+int block_generate_vertices(const block_data_t *neighbors[27], int effects,
+                            voxel_vertex_t *out);
+// Get the voxels of a block plus the one voxel shell around it, read from
+// the neighbors.  The voxel (x, y, z) of the block is at (x + 1, y + 1,
+// z + 1) in out, of size (BLOCK_SIZE + 2)^3.
+void block_get_padded_voxels(const block_data_t *neighbors[27],
+                             uvec4b_t *out);
+void block_op(block_t *block, painter_t *painter, const box_t *box);
+bool block_is_empty(const block_t *block, bool fast);
+void block_merge(block_t *block, const block_t *other);
+uvec4b_t block_get_at(const block_t *block, const vec3_t *pos);
+void block_set_at(block_t *block, const vec3_t *pos, uvec4b_t v);
+// #############################
+
+
+
+// #### Mesh ###################
+typedef struct mesh mesh_t;
+struct mesh
+{
+    block_t *blocks;
+    block_t *index; // Hash table of the blocks by position.
+    int next_block_id;
+    int *ref;   // Used to implement copy on write of the blocks.
+};
+mesh_t *mesh_new(void);
+void mesh_clear(mesh_t *mesh);
+void mesh_delete(mesh_t *mesh);
+mesh_t *mesh_copy(const mesh_t *mesh);
+// Create a mesh with only the blocks of a mesh that intersect a box.  The
+// blocks data are shared.
+mesh_t *mesh_copy_box(const mesh_t *mesh, const box_t *box);
+void mesh_set(mesh_t **mesh, const mesh_t *other);
+box_t mesh_get_box(const mesh_t *mesh, bool exact);
+void mesh_fill(mesh_t *mesh,
+               uvec4b_t (*get_color)(const vec3_t *pos, void *user_data),
+               void *user_data);
+void mesh_op(mesh_t *mesh, painter_t *painter, const box_t *box);
+// Same as mesh_op, but without using or filling the operations cache, for
+// meshes that are only used once.
+void mesh_op_nocache(mesh_t *mesh, painter_t *painter, const box_t *box);
+// Change the box of an operation already applied to a mesh: mesh has to be
+// the result of the operation with the box prev on origin.  Only the blocks
+// affected by the difference between the two boxes get modified.
+void mesh_op_update(mesh_t *mesh, const mesh_t *origin, painter_t *painter,
+                    const box_t *box, const box_t *prev);
+void mesh_merge(mesh_t *mesh, const mesh_t *other);
+void mesh_add_block(mesh_t *mesh, block_data_t *data, const vec3_t *pos);
+void mesh_move(mesh_t *mesh, const mat4_t *mat);
+uvec4b_t mesh_get_at(const mesh_t *mesh, const vec3_t *pos);
+void mesh_set_at(mesh_t *mesh, const vec3_t *pos, uvec4b_t v);
+block_t *mesh_get_block_at(const mesh_t *mesh, const vec3_t *pos);
+void mesh_get_neighbors(const mesh_t *mesh, const block_t *block,
+                        const block_data_t *neighbors[27]);
+// Add to a_out and b_out the blocks of a and b at all the positions where
+// they differ, using empty blocks where there is no block.
+void mesh_diff(const mesh_t *a, const mesh_t *b,
+               mesh_t *a_out, mesh_t *b_out);
+// Replace the blocks of mesh at the positions of the blocks of other.  The
+// empty blocks of other remove the blocks of mesh.
+void mesh_replace_blocks(mesh_t *mesh, const mesh_t *other);
+// Memory used by the blocks list and index of a mesh, in bytes, not
+// counting the blocks data.  The list can be shared by several meshes.
+long mesh_get_blocks_size(const mesh_t *mesh);
+// #############################
+
+
+
+// #### Image ##################
+typedef struct layer layer_t;
+struct layer {
+    layer_t *next, *prev;
+    mesh_t  *mesh;
+    int     id;        // Unique in the image.
+    bool    visible;
+    char    name[128]; // 127 chars max.
+};
+
+// An entry of the undo history.  It only records the blocks that changed
+// since the previous entry, see image.c.
+typedef struct history history_t;
+struct history {
+    history_t   *next, *prev;   // next is the previous (older) entry.
+    // The layers before and after the change, their mesh only contains the
+    // blocks that changed (NULL if none did).
+    layer_t     *before, *after;
+    int         active_before, active_after;
+    bool        reordered;      // Set if the change moved layers.
+    long        size;           // Bytes retained by this entry.
+    bool        spilled;        // Set if the blocks are in the scratch file.
+    long        scratch_pos;    // Position in the scratch file, or 0.
+    uint64_t    serial;         // Unique among all the entries ever made.
+};
+
+// Keep track of what has already been written into a file, so that we can
+// do incremental saves.  Defined in save.c.
+typedef struct save_state save_state_t;
+
+// Temporary file where the old history entries are moved.  Defined in
+// save.c.
+typedef struct history_scratch history_scratch_t;
+
+// Append only file of the changes of an image.  Defined in save.c.
+typedef struct journal journal_t;
+
+typedef struct image image_t;
+struct image {
+    layer_t *layers;
+    layer_t *active_layer;
+
+    // For saving.
+    char    *path;
+    int     export_width;
+    int     export_height;
+    save_state_t *save_state;
+
+    int     layers_next_id;
+
+    history_t *history, *history_current;
+    image_t *history_base;  // Copy of the image as of the last push.
+    history_scratch_t *history_scratch;
+    journal_t *journal;     // Not owned.  Gets all the changes if set.
+};
+
+image_t *image_new(void);
+image_t *image_copy(image_t *img);
+void image_delete(image_t *img);
+// Create a new layer with an empty mesh, without adding it to the image.
+layer_t *image_new_layer(image_t *img, const char *name);
+void image_add_layer(image_t *img);
+void image_delete_layer(image_t *img, layer_t *layer);
+void image_move_layer(image_t *img, layer_t *layer, int d);
+void image_duplicate_layer(image_t *img, layer_t *layer);
+void image_merge_visible_layers(image_t *img);
+void image_history_push(image_t *img);
+// Undo or redo the last change.  If changes is set, it gets an empty block
+// at each position where the visible layers changed.
+void image_undo(image_t *img, mesh_t *changes);
+void image_redo(image_t *img, mesh_t *changes);
+// Set the layers of an image to their state after a history entry, only
+// using its after layers.  Used to replay the journal.
+void image_apply_history(image_t *img, const history_t *hist);
+// Return the memory retained by the undo history in bytes, not counting
+// what is shared with the image.  If nb is set, it gets the number of
+// entries.
+long image_get_history_size(const image_t *img, int *nb);
+// #############################
+
+
+// #### Files ##################
+// Save an image into a file, and return the number of bytes written, or -1
+// in case of error.  Only the blocks not already in the file according to
+// the state are appended when possible.
+long save_image(const image_t *img, const char *path,
+                save_state_t **state_ptr);
+// Load a file into a new image.  Can be called from any thread.  Return
+// NULL on error.  If progress is set, it is updated (atomically) with the
+// loading progress in percent.
+image_t *load_image(const char *path, bool check_crc, int *progress);
+void save_state_delete(save_state_t *state);
+// Move the blocks of a history entry to a scratch file, created if needed,
+// or load them back.  Return 0 on success, or -1 and leave the entry
+// unchanged.
+int history_spill(history_t *hist, history_scratch_t **scratch);
+int history_unspill(history_t *hist, history_scratch_t *scratch);
+void history_scratch_delete(history_scratch_t *scratch);
+// Create a journal file, with no checkpoint yet.
+journal_t *journal_new(const char *path);
+// Close the journal, without deleting the file.
+void journal_delete(journal_t *journal);
+// Size of the journal file, not counting the changes still pending.
+long journal_get_size(journal_t *journal);
+// Number of changes added but not written to the file yet.
+int journal_get_pending(journal_t *journal);
+// Queue the state of the layers before (undo) or after a history entry, to
+// be appended to the file by a background thread.
+int journal_add(journal_t *journal, const history_t *hist, bool undo);
+// Append the end of the journal, from pos, to a checkpoint file (a full
+// save of the image), then replace the journal with it.
+int journal_checkpoint(journal_t *journal, const char *path, long pos);
+// #############################
+
+
+// #### Colors functions #######
+uvec3b_t hsl_to_rgb(uvec3b_t hsl);
+uvec3b_t rgb_to_hsl(uvec3b_t rgb);
+// #############################
+
+
+// #### Export #################
+// Faces generated by the exporters.
+enum {
+    EXPORT_CUBES,           // The voxels faces.
+    EXPORT_CUBES_MERGED,    // The voxels faces, coplanar faces merged.
+    EXPORT_SMOOTH,          // Smooth surface from the voxels alpha.
+};
+
+// If texture is set, also write a palette texture and a mtl file next to
+// the obj file, instead of using the vertices colors.
+// All the exporters return 0 on success, -1 on error.
+int wavefront_export(const mesh_t *mesh, const char *path, int mode,
+                     bool texture);
+int ply_export(const mesh_t *mesh, const char *path, bool ascii, int mode);
+int stl_export(const mesh_t *mesh, const char *path, int mode);
+// Export as binary glTF.
+int gltf_export(const mesh_t *mesh, const char *path, int mode);
+
+// Convert nb files, loading inputs[i] and exporting to outputs[i], the
+// format being chosen from the output extension.  Doesn't need a GL
+// context.  nb_threads is the total number of threads to use, 0 for auto.
+// Return 0 if all the files were converted, -1 otherwise.
+int goxel_convert(const char **inputs, const char **outputs, int nb,
+                  int nb_threads, int mode);
+// #############################
+
+
+
+// #### Profiler ###############
+
+typedef struct profiler_block profiler_block_t;
+struct profiler_block
+{
+    const char          *name;
+    profiler_block_t    *next;   // All the blocks are put in a list.
+    profiler_block_t    *parent; // The block that called this block.
+    int                 depth;   // How many time are we inside this block.
+    int                 count;
+
+    // In nanoseconds
+    int64_t             tot_time;
+    int64_t             self_time;
+    int64_t             enter_time;
+};
+// Counters for values that are not timings, like the size of a save.
+typedef struct profiler_counter profiler_counter_t;
+struct profiler_counter
+{
+    const char          *name;
+    profiler_counter_t  *next;   // All the counters are put in a list.
+    bool                registered;
+    int64_t             value;
+};
+
+void profiler_start(void);
+void profiler_stop(void);
+void profiler_tick(void);
+profiler_block_t *profiler_get_blocks();
+profiler_counter_t *profiler_get_counters();
+
+void profiler_enter_(profiler_block_t *block);
+void profiler_exit_(profiler_block_t *block);
+void profiler_counter_set_(profiler_counter_t *counter, int64_t value);
+void profiler_counter_add_(profiler_counter_t *counter, int64_t value);
+static inline void profiler_cleanup_(profiler_block_t **p)
+{
+    profiler_exit_(*p);
+}
+
+#ifndef PROFILER
+    #define PROFILER DEBUG
+#endif
+#if PROFILER
+    #define PROFILED2(name_) \
+        static profiler_block_t block_ = {name_}; \
+        profiler_enter_(&block_); \
+        profiler_block_t *block_ref_ \
+                __attribute__((cleanup(profiler_cleanup_))); \
+        block_ref_ = &block_;
+    #define PROFILER_COUNTER_SET(name_, v) do { \
+        static profiler_counter_t counter_ = {name_}; \
+        profiler_counter_set_(&counter_, v); \
+    } while (0)
+    #define PROFILER_COUNTER_ADD(name_, v) do { \
+        static profiler_counter_t counter_ = {name_}; \
+        profiler_counter_add_(&counter_, v); \
+    } while (0)
+#else
+    #define PROFILED2(name_)
+    #define PROFILER_COUNTER_SET(name_, v)
+    #define PROFILER_COUNTER_ADD(name_, v)
+#endif
+#define PROFILED PROFILED2(__func__)
+
+// #############################
+
+#endif // _CORE_H_
\ No newline at end of file
@@ -109,8 +109,9 @@ bool goxel_unproject_on_mesh(goxel_t *goxel, const vec2_t *view_size,
                              const vec2_t *pos, mesh_t *mesh,
                              vec3_t *out, vec3_t *normal)
 {
-    // XXX: No need to render the fbo if it is not dirty.
     extern const vec3b_t FACES_NORMALS[6];
+    typeof(goxel->pick_fbo_state) *state = &goxel->pick_fbo_state;
+    #define EQUAL(a, b) (memcmp(&(a), &(b), sizeof(a)) == 0)
 
     if (goxel->pick_fbo && !vec2_equal(
                 vec2(goxel->pick_fbo->w, goxel->pick_fbo->h), *view_size)) {
@@ -122,6 +123,8 @@ bool goxel_unproject_on_mesh(goxel_t *goxel, const vec2_t *view_size,
         goxel->pick_fbo = texture_create_buffer(
                 view_size->x, view_size->y, TF_DEPTH);
         texture_inc_ref(goxel->pick_fbo);
+        mesh_delete(state->mesh);
+        state->mesh = NULL;
     }
 
     renderer_t rend = {.material = goxel->rend.material};
@@ -133,10 +136,22 @@ bool goxel_unproject_on_mesh(goxel_t *goxel, const vec2_t *view_size,
 
     GL(glViewport(0, 0, view_size->x, view_size->y));
     GL(glBindFramebuffer(GL_FRAMEBUFFER, goxel->pick_fbo->framebuffer));
-    GL(glClearColor(0, 0, 0, 0));
-    GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
-    render_mesh(&rend, mesh, EFFECT_RENDER_POS);
-    render_render(&rend, &goxel->camera.view_mat, &goxel->camera.proj_mat);
+    // We keep a copy of the mesh, so if the blocks are the same they didn't
+    // change.
+    if (    !state->mesh || state->mesh->blocks != mesh->blocks ||
+            !EQUAL(state->view_mat, goxel->camera.view_mat) ||
+            !EQUAL(state->proj_mat, goxel->camera.proj_mat) ||
+            !EQUAL(state->rend.material, rend.material)) {
+        GL(glClearColor(0, 0, 0, 0));
+        GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
+        render_mesh(&rend, mesh, EFFECT_RENDER_POS);
+        render_render(&rend, &goxel->camera.view_mat, &goxel->camera.proj_mat);
+        mesh_set(&state->mesh, mesh);
+        state->view_mat = goxel->camera.view_mat;
+        state->proj_mat = goxel->camera.proj_mat;
+        state->rend = rend;
+    }
+    #undef EQUAL
 
     x = nearbyint(pos->x);
     y = view_size->y - nearbyint(pos->y) - 1;
@@ -197,8 +212,8 @@ void goxel_init(goxel_t *goxel)
     g_goxel = goxel;
     memset(goxel, 0, sizeof(*goxel));
 
+    core_init(&goxel->core);
     render_init();
-    shapes_init();
     goxel->camera.ofs = vec3_zero;
     goxel->camera.rot = quat_identity;
     goxel->camera.dist = 128;
@@ -242,6 +257,7 @@ void goxel_init(goxel_t *goxel)
     model3d_init();
     goxel->plane = plane(vec3(0.5, 0.5, 0.5), vec3(1, 0, 0), vec3(0, 0, -1));
     goxel->snap = SNAP_PLANE | SNAP_MESH;
+    goxel->autosave_interval = 60;
     gui_init();
 }
 
@@ -254,8 +270,11 @@ void goxel_iter(goxel_t *goxel, inputs_t *inputs)
 {
     profiler_tick();
     goxel_set_help_text(goxel, NULL);
+    load_iter(goxel);
     goxel->screen_size = vec2i(inputs->window_size[0], inputs->window_size[1]);
     gui_iter(goxel, inputs);
+    autosave_iter(goxel);
+    journal_iter(goxel);
     goxel->frame_count++;
 }
 
@@ -366,16 +385,158 @@ void goxel_render(goxel_t *goxel)
     gui_render();
 }
 
+/*
+ * The layers mesh is only merged again at the positions where the visible
+ * layers changed, so that the other blocks keep their data, and their
+ * render buffers.
+ *
+ * We keep a copy of the mesh of each visible layer as of the last update.
+ * Since the blocks data are copy on write, a block that changed since then
+ * has a different data than in the copy (even if the layer modified it in
+ * place before), and mesh_diff gives us the changed positions.
+ */
+static struct {
+    int     nb;
+    int     *ids;       // Ids of the visible layers, in order.
+    mesh_t  **meshes;   // Copy of the visible layers meshes.
+} g_composite = {};
+
+static void composite_save(const image_t *img)
+{
+    const layer_t *layer;
+    int i;
+    for (i = 0; i < g_composite.nb; i++)
+        mesh_delete(g_composite.meshes[i]);
+    g_composite.nb = 0;
+    DL_FOREACH(img->layers, layer) {
+        if (layer->visible) g_composite.nb++;
+    }
+    g_composite.ids = realloc(g_composite.ids,
+                              g_composite.nb * sizeof(*g_composite.ids));
+    g_composite.meshes = realloc(g_composite.meshes,
+                                 g_composite.nb * sizeof(*g_composite.meshes));
+    i = 0;
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->visible) continue;
+        g_composite.ids[i] = layer->id;
+        g_composite.meshes[i++] = mesh_copy(layer->mesh);
+    }
+}
+
+// Check if the visible layers are the same as for the last update.
+static bool composite_is_valid(const image_t *img)
+{
+    const layer_t *layer;
+    int i = 0;
+    DL_FOREACH(img->layers, layer) {
+        if (!layer->visible) continue;
+        if (i >= g_composite.nb || g_composite.ids[i] != layer->id)
+            return false;
+        i++;
+    }
+    return i == g_composite.nb;
+}
+
+// Only update the layers mesh at the positions of the blocks of a mesh.
+static void update_meshes_at(goxel_t *goxel, const mesh_t *changes,
+                             bool pick)
+{
+    mesh_t *merged = mesh_new();
+    const block_t *block;
+    block_t *dst;
+    layer_t *layer;
+    DL_FOREACH(changes->blocks, block) {
+        mesh_add_block(merged, NULL, &block->pos);
+        dst = mesh_get_block_at(merged, &block->pos);
+        DL_FOREACH(goxel->image->layers, layer) {
+            if (!layer->visible) continue;
+            block_merge(dst, mesh_get_block_at(layer->mesh, &block->pos));
+        }
+    }
+    mesh_replace_blocks(goxel->layers_mesh, merged);
+    if (pick)
+        mesh_set(&goxel->pick_mesh, goxel->layers_mesh);
+    mesh_delete(merged);
+    composite_save(goxel->image);
+    mesh_delete(goxel->preview_mesh);
+    goxel->preview_mesh = NULL;
+}
+
 void goxel_update_meshes(goxel_t *goxel, bool pick)
 {
     layer_t *layer;
-    mesh_clear(goxel->layers_mesh);
+    mesh_t *changes, *copy, *a, *b;
+    const block_t *block;
+    int i = 0;
+
+    if (!composite_is_valid(goxel->image)) {
+        mesh_clear(goxel->layers_mesh);
+        DL_FOREACH(goxel->image->layers, layer) {
+            if (!layer->visible) continue;
+            mesh_merge(goxel->layers_mesh, layer->mesh);
+        }
+        if (pick)
+            mesh_set(&goxel->pick_mesh, goxel->layers_mesh);
+        composite_save(goxel->image);
+        mesh_delete(goxel->preview_mesh);
+        goxel->preview_mesh = NULL;
+        return;
+    }
+
+    changes = mesh_new();
     DL_FOREACH(goxel->image->layers, layer) {
         if (!layer->visible) continue;
-        mesh_merge(goxel->layers_mesh, layer->mesh);
+        copy = g_composite.meshes[i++];
+        if (copy->blocks == layer->mesh->blocks) continue;
+        a = mesh_new();
+        b = mesh_new();
+        mesh_diff(copy, layer->mesh, a, b);
+        DL_FOREACH(a->blocks, block) {
+            if (!mesh_get_block_at(changes, &block->pos))
+                mesh_add_block(changes, NULL, &block->pos);
+        }
+        mesh_delete(a);
+        mesh_delete(b);
     }
-    if (pick)
-        mesh_set(&goxel->pick_mesh, goxel->layers_mesh);
+    update_meshes_at(goxel, changes, pick);
+    mesh_delete(changes);
+}
+
+/*
+ * The tools previews are only computed on the blocks that the operation
+ * can touch, and rendered over the layers mesh, so that hovering costs the
+ * same whatever the size of the image.
+ */
+void goxel_set_preview(goxel_t *goxel, painter_t *painter, const box_t *box)
+{
+    layer_t *layer, *active = goxel->image->active_layer;
+    mesh_t *mesh, *preview = mesh_new();
+    const block_t *block;
+    block_t *dst;
+    box_t bbox = bbox_grow(box_get_bbox(*box), 1, 1, 1);
+
+    mesh = mesh_copy_box(active->mesh, &bbox);
+    DL_FOREACH(mesh->blocks, block)
+        mesh_add_block(preview, NULL, &block->pos);
+    // The mesh is thrown away, so no need to keep it in the ops cache.
+    mesh_op_nocache(mesh, painter, box);
+    DL_FOREACH(mesh->blocks, block) {
+        if (!mesh_get_block_at(preview, &block->pos))
+            mesh_add_block(preview, NULL, &block->pos);
+    }
+    // Merge the layers at those positions, using the result of the
+    // operation for the active layer.  The blocks that end up empty are
+    // kept, to hide the blocks of the layers mesh.
+    DL_FOREACH(preview->blocks, dst) {
+        DL_FOREACH(goxel->image->layers, layer) {
+            if (!layer->visible) continue;
+            block_merge(dst, mesh_get_block_at(
+                        layer == active ? mesh : layer->mesh, &dst->pos));
+        }
+    }
+    mesh_delete(mesh);
+    mesh_delete(goxel->preview_mesh);
+    goxel->preview_mesh = preview;
 }
 
 // XXX: this function has to be rewritten.
@@ -414,14 +575,26 @@ void goxel_export_as_png(goxel_t *goxel, const char *path)
     texture_save_to_file(fbo, path, 0);
 }
 
-void goxel_export_as_obj(goxel_t *goxel, const char *path)
+int goxel_export_as_obj(goxel_t *goxel, const char *path, int mode,
+                        bool texture)
 {
-    wavefront_export(goxel->layers_mesh, path);
+    return wavefront_export(goxel->layers_mesh, path, mode, texture);
 }
 
-void goxel_export_as_ply(goxel_t *goxel, const char *path)
+int goxel_export_as_ply(goxel_t *goxel, const char *path, bool ascii,
+                        int mode)
 {
-    ply_export(goxel->layers_mesh, path);
+    return ply_export(goxel->layers_mesh, path, ascii, mode);
+}
+
+int goxel_export_as_stl(goxel_t *goxel, const char *path, int mode)
+{
+    return stl_export(goxel->layers_mesh, path, mode);
+}
+
+int goxel_export_as_gltf(goxel_t *goxel, const char *path, int mode)
+{
+    return gltf_export(goxel->layers_mesh, path, mode);
 }
 
 void goxel_set_help_text(goxel_t *goxel, const char *msg, ...)
@@ -435,14 +608,21 @@ void goxel_set_help_text(goxel_t *goxel, const char *msg, ...)
     va_end(args);
 }
 
+
 void goxel_undo(goxel_t *goxel)
 {
+    mesh_t *changes = mesh_new();
     tool_cancel(goxel, goxel->tool, goxel->tool_state);
-    image_undo(goxel->image);
+    image_undo(goxel->image, changes);
+    update_meshes_at(goxel, changes, true);
+    mesh_delete(changes);
 }
 
 void goxel_redo(goxel_t *goxel)
 {
+    mesh_t *changes = mesh_new();
     tool_cancel(goxel, goxel->tool, goxel->tool_state);
-    image_redo(goxel->image);
+    image_redo(goxel->image, changes);
+    update_meshes_at(goxel, changes, true);
+    mesh_delete(changes);
 }
@@ -19,79 +19,7 @@
 #ifndef _GOXEL_H_
 #define _GOXEL_H_
 
-#ifndef _GNU_SOURCE
-#   define _GNU_SOURCE
-#endif
-
-#ifndef NOMINMAX
-#   define NOMINMAX
-#endif
-
-#include "vec.h"
-#include "utlist.h"
-#include "uthash.h"
-#include "utarray.h"
-#include "ivec.h"
-#include <float.h>
-#include <stdbool.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <string.h>
-
-#define GOXEL_VERSION_STR "0.1.0"
-
-// #### Set the DEBUG macro ####
-#ifndef DEBUG
-#   if !defined(NDEBUG)
-#       define DEBUG 1
-#   else
-#       define DEBUG 0
-#   endif
-#endif
-// #############################
-
-
-
-// #### DEFINED macro ##########
-// DEFINE(NAME) returns 1 if NAME is defined to 1, 0 otherwise.
-#define DEFINED(macro) DEFINED_(macro)
-#define macrotest_1 ,
-#define DEFINED_(value) DEFINED__(macrotest_##value)
-#define DEFINED__(comma) DEFINED___(comma 1, 0)
-#define DEFINED___(_, v, ...) v
-// #############################
-
-
-// #### Logging macros #########
-
-enum {
-    LOG_VERBOSE = 2,
-    LOG_DEBUG   = 3,
-    LOG_INFO    = 4,
-    LOG_WARN    = 5,
-    LOG_ERROR   = 6,
-};
-
-#ifndef LOG_LEVEL
-#   if DEBUG
-#       define LOG_LEVEL LOG_DEBUG
-#   else
-#       define LOG_LEVEL LOG_INFO
-#   endif
-#endif
-
-#define LOG(level, msg, ...) do { \
-    if (level >= LOG_LEVEL) \
-        dolog(level, msg, __func__, __FILE__, __LINE__, ##__VA_ARGS__); \
-} while(0)
-
-#define LOG_V(msg, ...) LOG(LOG_VERBOSE, msg, ##__VA_ARGS__)
-#define LOG_D(msg, ...) LOG(LOG_DEBUG,   msg, ##__VA_ARGS__)
-#define LOG_I(msg, ...) LOG(LOG_INFO,    msg, ##__VA_ARGS__)
-#define LOG_W(msg, ...) LOG(LOG_WARN,    msg, ##__VA_ARGS__)
-#define LOG_E(msg, ...) LOG(LOG_ERROR,   msg, ##__VA_ARGS__)
-// #############################
-
+#include "core.h"
 
 
 // #### Include OpenGL #########
@@ -134,90 +62,16 @@ enum {
 
 
 
-// ### Some useful inline functions / macros.
-
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
-#define SWAP(x0, x) {typeof(x0) tmp = x0; x0 = x; x = tmp;}
-
-static inline uvec4b_t HEXCOLOR(uint32_t v)
-{
-    return uvec4b((v >> 24) & 0xff,
-                  (v >> 16) & 0xff,
-                  (v >>  8) & 0xff,
-                  (v >>  0) & 0xff);
-}
-
-static inline vec4_t uvec4b_to_vec4(uvec4b_t v)
-{
-    return vec4(v.x / 255., v.y / 255., v.z / 255., v.w / 255.);
-}
-
-#define min(a, b) ({ \
-      __typeof__ (a) _a = (a); \
-      __typeof__ (b) _b = (b); \
-      _a < _b ? _a : _b; \
-      })
-
-#define max(a, b) ({ \
-      __typeof__ (a) _a = (a); \
-      __typeof__ (b) _b = (b); \
-      _a > _b ? _a : _b; \
-      })
-
-#define clamp(x, a, b) (min(max(x, a), b))
-
-#define sign(x) ({ \
-      __typeof__ (x) _x = (x); \
-      (_x > 0) ? +1 : (_x < 0)? -1 : 0; \
-      })
-
-static inline float smoothstep(float edge0, float edge1, float x)
-{
-    x = clamp((x - edge0) / (edge1 - edge0), 0.0f, 1.0f);
-    return x * x * (3.0f - 2.0f * x);
-}
-
-static inline float mix(float x, float y, float t)
-{
-    return (1.0 - t) * x + t * y;
-}
-
-// #############################
-
-// XXX: I should clean up a but the code of vec.h so that I can put those on
-// top.
-#include "box.h"
-#include "plane.h"
-
-
-// #### Utils ##################
-
-// Used internally by the LOG macro
-void dolog(int level, const char *msg,
-           const char *func, const char *file, int line, ...);
+// #### GL utils ###############
 int check_gl_errors(const char *file, int line);
 int create_program(const char *vertex_shader, const char *fragment_shader,
                    const char *include);
 void delete_program(int prog);
-unsigned int gox_rand(void);
-float gox_frand(float min, float max);
-uint8_t *img_read(const char *path, int *width, int *height, int *bpp);
-uint8_t *img_read_from_mem(const char *data, int size,
-                           int *w, int *h, int *bpp);
-void img_write(const uint8_t *img, int w, int h, int bpp, const char *path);
-uint8_t *img_write_to_mem(const uint8_t *img, int w, int h, int bpp,
-                          int *size);
-bool str_endswith(const char *str, const char *end);
-
 // #############################
 
 
 
 // #### System #################
-void sys_log(const char *msg);
-const char *sys_get_data_dir(void);
-bool sys_asset_exists(const char *path);
-char *sys_read_asset(const char *path, int *size);
 GLuint sys_get_screen_framebuffer(void);
 bool sys_save_dialog(const char *type, char **path);
 bool sys_open_dialog(const char *type, char **path);
@@ -295,14 +149,7 @@ void textures_release_all();
 void textures_regenerate_all();
 // #############################
 
-// #### Tool/Operation/Painter #
-enum {
-    OP_NULL,
-    OP_ADD,
-    OP_SUB,
-    OP_PAINT,
-};
-
+// #### Tools ##################
 enum {
     TOOL_BRUSH,
     TOOL_CUBE,
@@ -310,114 +157,10 @@ enum {
     TOOL_SET_PLANE,
     TOOL_MOVE,
 };
-
-typedef struct shape {
-    float (*func)(const vec3_t *p, const vec3_t *s);
-} shape_t;
-
-void shapes_init(void);
-extern shape_t shape_sphere;
-extern shape_t shape_cube;
-extern shape_t shape_cylinder;
-
-
-// The painting context, including the tool, brush, operation, radius,
-// color, etc...
-typedef struct painter {
-    int         op;
-    shape_t     *shape;
-    uvec4b_t    color;
-} painter_t;
-
-// #### Block ##################
-// The block size can only be 16.
-#define BLOCK_SIZE 16
-#define VOXEL_TEXTURE_SIZE 8
-
-// Structure used for the OpenGL array data of blocks.
-// XXX: we can probably make it smaller.
-typedef struct voxel_vertex
-{
-    vec3b_t  pos        __attribute__((aligned(4)));
-    vec3b_t  normal     __attribute__((aligned(4)));
-    uvec4b_t color      __attribute__((aligned(4)));
-    uvec2b_t pos_data   __attribute__((aligned(4)));
-    uvec2b_t bshadow_uv __attribute__((aligned(4)));
-    uvec2b_t bump_uv    __attribute__((aligned(4)));
-} voxel_vertex_t;
-
-// We use copy on write for the block data, so that it is cheap to copy
-// blocks.
-typedef struct block_data block_data_t;
-struct block_data
-{
-    int         ref;
-    int         id;
-    uvec4b_t    voxels[BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE]; // RGBA voxels.
-};
-
-typedef struct block block_t;
-struct block
-{
-    block_t         *next, *prev;   // All the blocks are in a list.
-    block_data_t    *data;
-    vec3_t          pos;
-    int             id;
-};
-block_t *block_new(const vec3_t *pos, block_data_t *data);
-void block_delete(block_t *block);
-block_t *block_copy(const block_t *other);
-box_t block_get_box(const block_t *block, bool exact);
-void block_fill(block_t *block,
-                uvec4b_t (*get_color)(const vec3_t *pos, void *user_data),
-                void *user_data);
-int block_generate_vertices(const block_data_t *data, int effects,
-                            voxel_vertex_t *out);
-void block_op(block_t *block, painter_t *painter, const box_t *box);
-bool block_is_empty(const block_t *block, bool fast);
-void block_merge(block_t *block, const block_t *other);
-uvec4b_t block_get_at(const block_t *block, const vec3_t *pos);
 // #############################
 
-
-
-// #### Mesh ###################
-typedef struct mesh mesh_t;
-struct mesh
-{
-    block_t *blocks;
-    int next_block_id;
-    int *ref;   // Used to implement copy on write of the blocks.
-};
-mesh_t *mesh_new(void);
-void mesh_clear(mesh_t *mesh);
-void mesh_delete(mesh_t *mesh);
-mesh_t *mesh_copy(const mesh_t *mesh);
-void mesh_set(mesh_t **mesh, const mesh_t *other);
-box_t mesh_get_box(const mesh_t *mesh, bool exact);
-void mesh_fill(mesh_t *mesh,
-               uvec4b_t (*get_color)(const vec3_t *pos, void *user_data),
-               void *user_data);
-void mesh_op(mesh_t *mesh, painter_t *painter, const box_t *box);
-void mesh_merge(mesh_t *mesh, const mesh_t *other);
-void mesh_add_block(mesh_t *mesh, block_data_t *data, const vec3_t *pos);
-void mesh_move(mesh_t *mesh, const mat4_t *mat);
-uvec4b_t mesh_get_at(const mesh_t *mesh, const vec3_t *pos);
-// #############################
-
-
-
 // #### Renderer ###############
 
-enum {
-    EFFECT_RENDER_POS       = 1 << 1,
-    EFFECT_SMOOTH           = 1 << 2,
-    EFFECT_BORDERS          = 1 << 3,
-    EFFECT_BORDERS_ALL      = 1 << 4,
-    EFFECT_SEMI_TRANSPARENT = 1 << 5,
-    EFFECT_SEE_BACK         = 1 << 6,
-};
-
 typedef struct renderer renderer_t;
 typedef struct render_item_t render_item_t;
 struct renderer
@@ -445,6 +188,10 @@ struct renderer
 void render_init(void);
 void render_deinit(void);
 void render_mesh(renderer_t *rend, const mesh_t *mesh, int effects);
+// Render a mesh where the blocks of an overlay mesh replace the blocks at
+// the same positions, an empty block hiding the block of the mesh.
+void render_mesh_overlay(renderer_t *rend, const mesh_t *mesh,
+                         const mesh_t *overlay, int effects);
 void render_plane(renderer_t *rend, const plane_t *plane,
                   const uvec4b_t *color);
 void render_line(renderer_t *rend, const vec3_t *a, const vec3_t *b);
@@ -526,46 +273,14 @@ typedef struct inputs
     bool        keys[512]; // Table of all the pressed keys.
     uint32_t    chars[16];
     vec2_t      mouse_pos;
+    // All the mouse positions we got since the last iteration, in order,
+    // so that the tools can follow fast movements.
+    vec2_t      mouse_samples[32];
+    int         nb_mouse_samples;
     bool        mouse_down[3];
     float       mouse_wheel;
 } inputs_t;
 
-typedef struct history history_t;
-
-typedef struct layer layer_t;
-struct layer {
-    layer_t *next, *prev;
-    mesh_t  *mesh;
-    bool    visible;
-    char    name[128]; // 127 chars max.
-};
-
-typedef struct image image_t;
-struct image {
-    layer_t *layers;
-    layer_t *active_layer;
-
-    // For saving.
-    char    *path;
-    int     export_width;
-    int     export_height;
-
-    image_t *history;
-    image_t *history_next, *history_prev, *history_current;
-};
-
-image_t *image_new(void);
-image_t *image_copy(image_t *img);
-void image_delete(image_t *img);
-void image_add_layer(image_t *img);
-void image_delete_layer(image_t *img, layer_t *layer);
-void image_move_layer(image_t *img, layer_t *layer, int d);
-void image_duplicate_layer(image_t *img, layer_t *layer);
-void image_merge_visible_layers(image_t *img);
-void image_history_push(image_t *img);
-void image_undo(image_t *img);
-void image_redo(image_t *img);
-
 typedef struct goxel
 {
     vec2i_t    screen_size;
@@ -573,8 +288,9 @@ typedef struct goxel
 
     mesh_t     *layers_mesh; // All the layers combined.
     mesh_t     *pick_mesh;
+    // Blocks of layers_mesh replaced by the preview of a tool, or NULL.
+    mesh_t     *preview_mesh;
 
-    history_t  *history;     // Undo/redo history.
     int        snap;
     float      snap_offset;  // Only for brush tool.
 
@@ -600,6 +316,14 @@ typedef struct goxel
     uvec4b_t   grid_color;
 
     texture_t  *pick_fbo;
+    // What was last rendered in pick_fbo, so that we only render it again
+    // when something changed.
+    struct {
+        mesh_t     *mesh;
+        mat4_t     view_mat;
+        mat4_t     proj_mat;
+        renderer_t rend;
+    } pick_fbo_state;
     painter_t  painter;
     renderer_t rend;
 
@@ -618,6 +342,7 @@ typedef struct goxel
     }          tool_last_op;
     vec3_t     tool_start_pos;
     plane_t    tool_plane;
+    box_t      tool_box; // Box of the cube tool operation applied so far.
     bool       tool_plane_hidden_restore;
 
     struct {
@@ -633,9 +358,9 @@ typedef struct goxel
     char       *help_text;  // Seen in the bottom of the screen.
 
     int        frame_count;       // Global frames counter.
-    int        block_next_id;
 
-    int        block_count; // Counter for the number of block data.
+    float      autosave_interval; // In seconds, 0 to disable.
+    core_t     core;
 } goxel_t;
 goxel_t *goxel(void);
 void goxel_init(goxel_t *goxel);
@@ -658,9 +383,17 @@ bool goxel_unproject_on_plane(goxel_t *goxel, const vec2_t *view_size,
                      const vec2_t *pos, const plane_t *plane,
                      vec3_t *out, vec3_t *normal);
 void goxel_update_meshes(goxel_t *goxel, bool pick);
+// Show the result of an operation on the active layer without modifying
+// it, until the next update of the meshes.
+void goxel_set_preview(goxel_t *goxel, painter_t *painter, const box_t *box);
 void goxel_export_as_png(goxel_t *goxel, const char *path);
-void goxel_export_as_obj(goxel_t *goxel, const char *path);
-void goxel_export_as_ply(goxel_t *goxel, const char *path);
+// mode is one of the EXPORT_ values.
+int goxel_export_as_obj(goxel_t *goxel, const char *path, int mode,
+                        bool texture);
+int goxel_export_as_ply(goxel_t *goxel, const char *path, bool ascii,
+                        int mode);
+int goxel_export_as_stl(goxel_t *goxel, const char *path, int mode);
+int goxel_export_as_gltf(goxel_t *goxel, const char *path, int mode);
 void goxel_set_help_text(goxel_t *goxel, const char *msg, ...);
 void goxel_undo(goxel_t *goxel);
 void goxel_redo(goxel_t *goxel);
@@ -668,16 +401,28 @@ void goxel_redo(goxel_t *goxel);
 
 void save_to_file(goxel_t *goxel, const char *path);
 void load_from_file(goxel_t *goxel, const char *path);
+// Load a file from a background thread.  The current image is replaced
+// once the file is fully loaded, from load_iter.
+void load_from_file_async(goxel_t *goxel, const char *path);
+void load_iter(goxel_t *goxel);
+// Save a snapshot of the image in the background if it changed since the
+// last autosave.  Called at each frame.
+void autosave_iter(goxel_t *goxel);
+// Keep the journal of the changes of the image, used to recover from a
+// crash.  Called at each frame.
+void journal_iter(goxel_t *goxel);
+// Look for the journals of the previous sessions that did not exit
+// properly, and if load is set, replace the current image with the most
+// recent one.
+void journal_recover(goxel_t *goxel, bool load);
+// Close and delete the journal.  To call before exiting.
+void journal_release(void);
 
 
 int tool_iter(goxel_t *goxel, int tool, const inputs_t *inputs, int state,
               const vec2_t *view_size, bool inside);
 void tool_cancel(goxel_t *goxel, int tool, int state);
 
-// #### Colors functions #######
-uvec3b_t hsl_to_rgb(uvec3b_t hsl);
-uvec3b_t rgb_to_hsl(uvec3b_t rgb);
-
 // #### Gui ####################
 
 void gui_init(void);
@@ -686,54 +431,4 @@ void gui_render(void);
 
 // #############################
 
-void wavefront_export(const mesh_t *mesh, const char *path);
-void ply_export(const mesh_t *mesh, const char *path);
-
-
-
-// #### Profiler ###############
-
-typedef struct profiler_block profiler_block_t;
-struct profiler_block
-{
-    const char          *name;
-    profiler_block_t    *next;   // All the blocks are put in a list.
-    profiler_block_t    *parent; // The block that called this block.
-    int                 depth;   // How many time are we inside this block.
-    int                 count;
-
-    // In nanoseconds
-    int64_t             tot_time;
-    int64_t             self_time;
-    int64_t             enter_time;
-};
-void profiler_start(void);
-void profiler_stop(void);
-void profiler_tick(void);
-profiler_block_t *profiler_get_blocks();
-
-void profiler_enter_(profiler_block_t *block);
-void profiler_exit_(profiler_block_t *block);
-static inline void profiler_cleanup_(profiler_block_t **p)
-{
-    profiler_exit_(*p);
-}
-
-#ifndef PROFILER
-    #define PROFILER DEBUG
-#endif
-#if PROFILER
-    #define PROFILED2(name_) \
-        static profiler_block_t block_ = {name_}; \
-        profiler_enter_(&block_); \
-        profiler_block_t *block_ref_ \
-                __attribute__((cleanup(profiler_cleanup_))); \
-        block_ref_ = &block_;
-#else
-    #define PROFILED2(name_)
-#endif
-#define PROFILED PROFILED2(__func__)
-
-// #############################
-
 #endif // _GOXEL_H_
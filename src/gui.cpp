@@ -319,7 +319,7 @@ void render_view(const ImDrawList* parent_list, const ImDrawCmd* cmd)
     GL(glClearColor(back_color.r, back_color.g, back_color.b, back_color.a));
     GL(glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT));
 
-    render_mesh(rend, goxel->layers_mesh, 0);
+    render_mesh_overlay(rend, goxel->layers_mesh, goxel->preview_mesh, 0);
     if (DEBUG) {
         box_t b;
         uvec4b_t c;
@@ -545,22 +545,32 @@ static void layers_panel(goxel_t *goxel)
     }
     if (ImGui::Button("Add")) {
         image_add_layer(goxel->image);
+        goxel_update_meshes(goxel, true);
     }
     ImGui::SameLine();
     if (ImGui::Button("Del")) {
         image_delete_layer(goxel->image, goxel->image->active_layer);
+        goxel_update_meshes(goxel, true);
     }
     ImGui::SameLine();
-    if (ImGui::Button("^"))
+    if (ImGui::Button("^")) {
         image_move_layer(goxel->image, goxel->image->active_layer, +1);
+        goxel_update_meshes(goxel, true);
+    }
     ImGui::SameLine();
-    if (ImGui::Button("v"))
+    if (ImGui::Button("v")) {
         image_move_layer(goxel->image, goxel->image->active_layer, -1);
-    if (ImGui::Button("Duplicate"))
+        goxel_update_meshes(goxel, true);
+    }
+    if (ImGui::Button("Duplicate")) {
         image_duplicate_layer(goxel->image, goxel->image->active_layer);
+        goxel_update_meshes(goxel, true);
+    }
     ImGui::SameLine();
-    if (ImGui::Button("Merge visible"))
+    if (ImGui::Button("Merge visible")) {
         image_merge_visible_layers(goxel->image);
+        goxel_update_meshes(goxel, true);
+    }
     ImGui::PopID();
 }
 
@@ -576,6 +586,20 @@ static void palette_panel(goxel_t *goxel)
     }
 }
 
+static void history_panel(goxel_t *goxel)
+{
+    int nb, budget;
+    long size = image_get_history_size(goxel->image, &nb);
+    ImGui::Text("%d steps, %.1f MiB", nb, (float)size / MiB);
+    budget = goxel->core.history_budget / MiB;
+    if (ImGui::InputInt("Budget (MiB)", &budget, 64)) {
+        goxel->core.history_budget = (long)max(budget, 0) * MiB;
+    }
+    // 0 keeps all the history in memory.
+    if (ImGui::InputInt("Steps in memory", &goxel->core.history_in_memory))
+        goxel->core.history_in_memory = max(goxel->core.history_in_memory, 0);
+}
+
 static void render_panel(goxel_t *goxel)
 {
     float v;
@@ -671,18 +695,34 @@ static void save(goxel_t *goxel)
     save_to_file(goxel, goxel->image->path);
 }
 
-static void export_as(goxel_t *goxel, const char *type)
+// format is the name of the exporter, type the file dialog filter.  If
+// smooth is set, the 3d formats export a smooth surface.
+static void export_as(goxel_t *goxel, const char *format, const char *type,
+                      bool smooth)
 {
     char *path = NULL;
+    int mode = smooth ? EXPORT_SMOOTH : EXPORT_CUBES;
     bool result = sys_save_dialog(type, &path);
     if (!result) return;
     // XXX: use a dialog to set the size and other parameters.
-    if (strcmp(type, "png") == 0)
+    if (strcmp(format, "png") == 0)
         goxel_export_as_png(goxel, path);
-    if (strcmp(type, "obj") == 0)
-        goxel_export_as_obj(goxel, path);
-    if (strcmp(type, "ply") == 0)
-        goxel_export_as_ply(goxel, path);
+    if (strcmp(format, "obj") == 0)
+        goxel_export_as_obj(goxel, path, mode, false);
+    if (strcmp(format, "obj texture") == 0)
+        goxel_export_as_obj(goxel, path, mode, true);
+    if (strcmp(format, "obj texture merged") == 0)
+        goxel_export_as_obj(goxel, path, EXPORT_CUBES_MERGED, true);
+    if (strcmp(format, "ply") == 0)
+        goxel_export_as_ply(goxel, path, true, mode);
+    if (strcmp(format, "ply binary") == 0)
+        goxel_export_as_ply(goxel, path, false, mode);
+    if (strcmp(format, "stl") == 0)
+        goxel_export_as_stl(goxel, path, mode);
+    if (strcmp(format, "glb") == 0)
+        goxel_export_as_gltf(goxel, path, mode);
+    if (strcmp(format, "glb merged") == 0)
+        goxel_export_as_gltf(goxel, path, EXPORT_CUBES_MERGED);
     free(path);
 }
 
@@ -691,13 +731,14 @@ static void load(goxel_t *goxel)
     char *path = NULL;
     bool result = sys_open_dialog("gox\0*.gox\0", &path);
     if (!result) return;
-    load_from_file(goxel, path);
+    load_from_file_async(goxel, path);
     free(path);
 }
 
 static void render_profiler_info(void)
 {
     profiler_block_t *block, *root;
+    profiler_counter_t *counter;
     int percent, fps;
     double time_per_frame;
     double self_time;
@@ -714,6 +755,9 @@ static void render_profiler_info(void)
         ImGui::BulletText("%s: self:%.1fms/frame (%d%%)",
                 block->name, self_time, percent);
     }
+    for (counter = profiler_get_counters(); counter; counter = counter->next)
+        ImGui::BulletText("%s: %lld", counter->name,
+                          (long long)counter->value);
 }
 
 void gui_iter(goxel_t *goxel, const inputs_t *inputs)
@@ -782,9 +826,28 @@ void gui_iter(goxel_t *goxel, const inputs_t *inputs)
                 load(goxel);
             }
             if (ImGui::BeginMenu("Export As..")) {
-                if (ImGui::MenuItem("png")) export_as(goxel, "png\0*.png\0");
-                if (ImGui::MenuItem("obj")) export_as(goxel, "obj\0*.obj\0");
-                if (ImGui::MenuItem("ply")) export_as(goxel, "ply\0*.ply\0");
+                static bool smooth = false;
+                if (ImGui::MenuItem("png"))
+                    export_as(goxel, "png", "png\0*.png\0", smooth);
+                if (ImGui::MenuItem("obj"))
+                    export_as(goxel, "obj", "obj\0*.obj\0", smooth);
+                if (ImGui::MenuItem("obj (palette texture)"))
+                    export_as(goxel, "obj texture", "obj\0*.obj\0", smooth);
+                if (ImGui::MenuItem("obj (palette texture, merged faces)"))
+                    export_as(goxel, "obj texture merged", "obj\0*.obj\0",
+                              smooth);
+                if (ImGui::MenuItem("ply"))
+                    export_as(goxel, "ply", "ply\0*.ply\0", smooth);
+                if (ImGui::MenuItem("ply (binary)"))
+                    export_as(goxel, "ply binary", "ply\0*.ply\0", smooth);
+                if (ImGui::MenuItem("stl"))
+                    export_as(goxel, "stl", "stl\0*.stl\0", smooth);
+                if (ImGui::MenuItem("glb"))
+                    export_as(goxel, "glb", "glb\0*.glb\0", smooth);
+                if (ImGui::MenuItem("glb (merged faces)"))
+                    export_as(goxel, "glb merged", "glb\0*.glb\0", smooth);
+                ImGui::Separator();
+                ImGui::Checkbox("Smooth surface", &smooth);
                 ImGui::EndMenu();
             }
             ImGui::EndMenu();
@@ -815,6 +878,9 @@ void gui_iter(goxel_t *goxel, const inputs_t *inputs)
     ImGui::Separator();
     if (ImGui::CollapsingHeader("Render", NULL, true, false))
         render_panel(goxel);
+    ImGui::Separator();
+    if (ImGui::CollapsingHeader("History", NULL, true, false))
+        history_panel(goxel);
     ImGui::EndChild();
     ImGui::SameLine();
 
@@ -836,6 +902,12 @@ void gui_iter(goxel_t *goxel, const inputs_t *inputs)
         rel_inputs.mouse_pos =
             vec2(ImGui::GetIO().MousePos.x - canvas_pos.x,
                  ImGui::GetIO().MousePos.y - canvas_pos.y);
+        for (int i = 0; i < inputs->nb_mouse_samples &&
+                        i < (int)ARRAY_SIZE(inputs->mouse_samples); i++) {
+            rel_inputs.mouse_samples[i] =
+                vec2(inputs->mouse_samples[i].x - canvas_pos.x,
+                     inputs->mouse_samples[i].y - canvas_pos.y);
+        }
         goxel_mouse_in_view(goxel, &view_size, &rel_inputs,
                 ImGui::IsItemHovered());
     }
@@ -849,9 +921,10 @@ void gui_iter(goxel_t *goxel, const inputs_t *inputs)
         ImGui::SetCursorPos(ImVec2(200, 30));
         ImGui::BeginChild("debug", ImVec2(0, 0), false,
                           ImGuiWindowFlags_NoInputs);
-        ImGui::Text("Blocks: %d (%.2g MiB)", goxel->block_count,
-                (float)goxel->block_count * sizeof(block_data_t) / MiB);
-        ImGui::Text("Blocks id: %d", goxel->block_next_id);
+        ImGui::Text("Blocks: %d (%.2g MiB)", goxel->core.block_count,
+                (float)goxel->core.block_count * sizeof(block_data_t) / MiB);
+        ImGui::Text("Blocks id: %llu",
+                    (unsigned long long)goxel->core.block_next_id);
         if (PROFILER)
             render_profiler_info();
         ImGui::EndChild();
@@ -16,30 +16,50 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
 
 static void print_history(const image_t *img)
 {
     if (!DEBUG) return;
-    const image_t *im;
+    const history_t *hist;
     int i = 0;
     LOG_V("hist");
-    DL_FOREACH2(img->history, im, history_next) {
-        LOG_V("%s %d (%p)", im == img->history_current ? "*" : " ", i, im);
+    DL_FOREACH(img->history, hist) {
+        LOG_V("%s %d (%p)", hist == img->history_current ? "*" : " ", i, hist);
         i++;
     }
 }
 
+static void history_delete(history_t *hist);
+
+static void layers_delete(layer_t **layers)
+{
+    layer_t *layer, *tmp;
+    DL_FOREACH_SAFE(*layers, layer, tmp) {
+        DL_DELETE(*layers, layer);
+        mesh_delete(layer->mesh);
+        free(layer);
+    }
+}
+
+layer_t *image_new_layer(image_t *img, const char *name)
+{
+    layer_t *layer;
+    layer = calloc(1, sizeof(*layer));
+    sprintf(layer->name, "%s", name);
+    layer->mesh = mesh_new();
+    layer->id = ++img->layers_next_id;
+    layer->visible = true;
+    return layer;
+}
+
 image_t *image_new(void)
 {
     layer_t *layer;
     image_t *img = calloc(1, sizeof(*img));
     img->export_width = 256;
     img->export_height = 256;
-    layer = calloc(1, sizeof(*img->layers));
-    sprintf(layer->name, "background");
-    layer->mesh = mesh_new();
-    layer->visible = true;
+    layer = image_new_layer(img, "background");
     DL_APPEND(img->layers, layer);
     img->active_layer = layer;
     image_history_push(img);
@@ -54,6 +74,12 @@ image_t *image_copy(image_t *other)
     *img = *other;
     img->layers = NULL;
     img->active_layer = NULL;
+    img->path = other->path ? strdup(other->path) : NULL;
+    img->save_state = NULL;
+    img->history = img->history_current = NULL;
+    img->history_base = NULL;
+    img->history_scratch = NULL;
+    img->journal = NULL;
     DL_FOREACH(other->layers, other_layer) {
         layer = calloc(1, sizeof(*layer));
         *layer = *other_layer;
@@ -69,12 +95,16 @@ image_t *image_copy(image_t *other)
 
 void image_delete(image_t *img)
 {
-    layer_t *layer, *tmp;
-    DL_FOREACH_SAFE(img->layers, layer, tmp) {
-        DL_DELETE(img->layers, layer);
-        mesh_delete(layer->mesh);
-        free(layer);
+    history_t *hist, *hist_tmp;
+    if (!img) return;
+    layers_delete(&img->layers);
+    DL_FOREACH_SAFE(img->history, hist, hist_tmp) {
+        DL_DELETE(img->history, hist);
+        history_delete(hist);
     }
+    image_delete(img->history_base);
+    history_scratch_delete(img->history_scratch);
+    save_state_delete(img->save_state);
     free(img->path);
     free(img);
 }
@@ -82,14 +112,10 @@ void image_delete(image_t *img)
 void image_add_layer(image_t *img)
 {
     layer_t *layer;
-    layer = (layer_t*)calloc(1, sizeof(*layer));
-    sprintf(layer->name, "unamed");
-    layer->mesh = mesh_new();
-    layer->visible = true;
+    layer = image_new_layer(img, "unamed");
     DL_APPEND(img->layers, layer);
     img->active_layer = layer;
     image_history_push(img);
-    goxel_update_meshes(goxel(), true);
 }
 
 void image_delete_layer(image_t *img, layer_t *layer)
@@ -99,15 +125,11 @@ void image_delete_layer(image_t *img, layer_t *layer)
     mesh_delete(layer->mesh);
     free(layer);
     if (img->layers == NULL) {
-        layer = (layer_t*)calloc(1, sizeof(*layer));
-        layer->mesh = mesh_new();
-        sprintf(layer->name, "unamed");
-        layer->visible = true;
+        layer = image_new_layer(img, "unamed");
         DL_APPEND(img->layers, layer);
     }
     if (!img->active_layer) img->active_layer = img->layers->prev;
     image_history_push(img);
-    goxel_update_meshes(goxel(), true);
 }
 
 void image_move_layer(image_t *img, layer_t *layer, int d)
@@ -124,20 +146,16 @@ void image_move_layer(image_t *img, layer_t *layer, int d)
     DL_DELETE(img->layers, layer);
     DL_PREPEND_ELEM(img->layers, other, layer);
     image_history_push(img);
-    goxel_update_meshes(goxel(), true);
 }
 
 void image_duplicate_layer(image_t *img, layer_t *other)
 {
     layer_t *layer;
-    layer = (layer_t*)calloc(1, sizeof(*layer));
-    sprintf(layer->name, "%s", other->name);
-    layer->mesh = mesh_copy(other->mesh);
-    layer->visible = true;
+    layer = image_new_layer(img, other->name);
+    mesh_set(&layer->mesh, other->mesh);
     DL_APPEND(img->layers, layer);
     img->active_layer = layer;
     image_history_push(img);
-    goxel_update_meshes(goxel(), true);
 }
 
 void image_merge_visible_layers(image_t *img)
@@ -155,55 +173,385 @@ void image_merge_visible_layers(image_t *img)
     }
     if (last) img->active_layer = last;
     image_history_push(img);
-    goxel_update_meshes(goxel(), true);
 }
 
-void image_set(image_t *img, image_t *other)
+/*
+ * Undo history.
+ *
+ * Each entry only records, for each layer, the blocks that changed with
+ * their data before and after the change, so that pushing, undoing and
+ * redoing costs are proportional to the size of the change.  The blocks data
+ * is shared (copy on write) with the image, so recording a block is cheap.
+ *
+ * To know what changed, the image keeps a copy of itself as of the last
+ * push (history_base), that shares all its blocks with the image until they
+ * are modified.  The entries also record the list of layers before and
+ * after the change, so that we can undo the layers operations.
+ *
+ * We can never undo the oldest entry, so its blocks before the change are
+ * released when the older entries get deleted.
+ *
+ * Optionally, the entries far from the current one are moved to a scratch
+ * file (see save.c), and loaded back when we undo or redo them.
+ */
+
+static layer_t *get_layer(const layer_t *layers, int id)
+{
+    const layer_t *layer;
+    DL_FOREACH(layers, layer) {
+        if (layer->id == id) return (layer_t*)layer;
+    }
+    return NULL;
+}
+
+// Copy a layer without its blocks.
+static layer_t *layer_copy_header(const layer_t *other)
+{
+    layer_t *layer = calloc(1, sizeof(*layer));
+    *layer = *other;
+    layer->next = layer->prev = NULL;
+    layer->mesh = NULL;
+    return layer;
+}
+
+static void history_delete(history_t *hist)
+{
+    layers_delete(&hist->before);
+    layers_delete(&hist->after);
+    free(hist);
+}
+
+// Record the blocks that differ between two versions of a layer, a or b
+// being NULL if the layer was created or deleted.
+static void record_changes(const layer_t *a, const layer_t *b,
+                           layer_t *before, layer_t *after)
+{
+    mesh_t *empty = (!a || !b) ? mesh_new() : NULL;
+    mesh_t *a_out = mesh_new(), *b_out = mesh_new();
+    mesh_diff(a ? a->mesh : empty, b ? b->mesh : empty, a_out, b_out);
+    mesh_delete(empty);
+    if (!a_out->blocks) { // No changes.
+        mesh_delete(a_out);
+        mesh_delete(b_out);
+        return;
+    }
+    if (before) before->mesh = a_out; else mesh_delete(a_out);
+    if (after) after->mesh = b_out; else mesh_delete(b_out);
+}
+
+// Check if the layers present in both lists are in a different order.
+static bool is_reordered(const layer_t *a, const layer_t *b)
+{
+    const layer_t *layer;
+    DL_FOREACH(a, layer) {
+        if (!get_layer(b, layer->id)) continue;
+        while (!get_layer(a, b->id)) b = b->next;
+        if (b->id != layer->id) return true;
+        b = b->next;
+    }
+    return false;
+}
+
+// Create an entry with the changes between two states of an image, base
+// can be NULL for no previous state.
+static history_t *history_new(const image_t *base, const image_t *img)
+{
+    history_t *hist = calloc(1, sizeof(*hist));
+    const layer_t *base_layers = base ? base->layers : NULL, *layer;
+    layer_t *before, *after;
+
+    hist->serial = __atomic_add_fetch(&core()->history_next_serial, 1,
+                                      __ATOMIC_RELAXED);
+
+    DL_FOREACH(base_layers, layer) {
+        before = layer_copy_header(layer);
+        DL_APPEND(hist->before, before);
+    }
+    DL_FOREACH(img->layers, layer) {
+        after = layer_copy_header(layer);
+        DL_APPEND(hist->after, after);
+        record_changes(get_layer(base_layers, layer->id), layer,
+                       get_layer(hist->before, layer->id), after);
+    }
+    DL_FOREACH(hist->before, before) {
+        if (get_layer(hist->after, before->id)) continue;
+        record_changes(get_layer(base_layers, before->id), NULL,
+                       before, NULL);
+    }
+    if (base) hist->active_before = base->active_layer->id;
+    hist->active_after = img->active_layer->id;
+    hist->reordered = is_reordered(hist->before, hist->after);
+    return hist;
+}
+
+// Check if an entry changes nothing, not counting the active layer.
+static bool history_is_empty(const history_t *hist)
+{
+    const layer_t *a, *b;
+    for (a = hist->before, b = hist->after; a && b; a = a->next, b = b->next) {
+        if (a->mesh || b->mesh) return false;
+        if (a->id != b->id || a->visible != b->visible) return false;
+        if (strcmp(a->name, b->name) != 0) return false;
+    }
+    return !a && !b;
+}
+
+// Add an empty block at each position of the blocks of a mesh.
+static void add_positions(mesh_t *changes, const mesh_t *mesh)
+{
+    const block_t *block;
+    if (!changes || !mesh) return;
+    DL_FOREACH(mesh->blocks, block) {
+        if (!mesh_get_block_at(changes, &block->pos))
+            mesh_add_block(changes, NULL, &block->pos);
+    }
+}
+
+// Set the layers of an image to their state before (undo) or after an
+// entry.  The image has to be in the other state.
+static void history_apply(image_t *img, const history_t *hist, bool undo,
+                          mesh_t *changes)
 {
-    layer_t *layer, *tmp, *other_layer;
+    const layer_t *target = undo ? hist->before : hist->after, *h;
+    int active = undo ? hist->active_before : hist->active_after;
+    layer_t *layers = NULL, *layer, *tmp;
+    mesh_t *mesh;
+    bool visible;
+
+    DL_FOREACH(target, h) {
+        layer = get_layer(img->layers, h->id);
+        if (layer) {
+            DL_DELETE(img->layers, layer);
+        } else {
+            layer = calloc(1, sizeof(*layer));
+            layer->mesh = mesh_new();
+        }
+        visible = layer->visible;
+        mesh = layer->mesh;
+        *layer = *h;
+        layer->mesh = mesh;
+        if (h->mesh) {
+            if (visible || layer->visible) add_positions(changes, h->mesh);
+            mesh_replace_blocks(layer->mesh, h->mesh);
+        }
+        if (visible != layer->visible || (hist->reordered && layer->visible))
+            add_positions(changes, layer->mesh);
+        DL_APPEND(layers, layer);
+    }
+    // The remaining layers don't exist in the target state.
     DL_FOREACH_SAFE(img->layers, layer, tmp) {
+        if (layer->visible) add_positions(changes, layer->mesh);
         DL_DELETE(img->layers, layer);
         mesh_delete(layer->mesh);
         free(layer);
     }
-    DL_FOREACH(other->layers, other_layer) {
-        layer = calloc(1, sizeof(*layer));
-        *layer = *other_layer;
-        layer->next = layer->prev = NULL;
-        layer->mesh = mesh_copy(other_layer->mesh);
-        DL_APPEND(img->layers, layer);
-        if (other_layer == other->active_layer)
-            img->active_layer = layer;
+    img->layers = layers;
+    img->active_layer = get_layer(img->layers, active) ?: img->layers->prev;
+}
+
+/*
+ * History memory accounting.
+ *
+ * A block data replaced by a change stays in the blocks before the change
+ * of the entry, and is released with it, so we charge it there, unless the
+ * image still uses it in another layer at the same position.  The data set
+ * by a change is charged to the entry that replaces it later.
+ *
+ * XXX: the charges are computed when the entries are pushed, while undone
+ * they can be off until the next push.
+ */
+
+typedef struct {
+    const void      *ptr;
+    UT_hash_handle  hh;
+} ptr_set_t;
+
+// Add a pointer to a set, return false if it was already there.
+static bool ptr_set_add(ptr_set_t **set, const void *ptr)
+{
+    ptr_set_t *item;
+    HASH_FIND_PTR(*set, &ptr, item);
+    if (item) return false;
+    item = calloc(1, sizeof(*item));
+    item->ptr = ptr;
+    HASH_ADD_PTR(*set, ptr, item);
+    return true;
+}
+
+static void ptr_set_clear(ptr_set_t **set)
+{
+    ptr_set_t *item, *tmp;
+    HASH_ITER(hh, *set, item, tmp) {
+        HASH_DEL(*set, item);
+        free(item);
+    }
+}
+
+static bool image_uses_data(const image_t *img, const block_t *block)
+{
+    const layer_t *layer;
+    const block_t *other;
+    DL_FOREACH(img->layers, layer) {
+        other = mesh_get_block_at(layer->mesh, &block->pos);
+        if (other && other->data == block->data) return true;
+    }
+    return false;
+}
+
+// Return the number of bytes retained by an entry pushed on an image.
+static long history_get_size(const history_t *hist, const image_t *img)
+{
+    ptr_set_t *datas = NULL;
+    const layer_t *layer;
+    const block_t *block;
+    long size = sizeof(*hist);
+
+    DL_FOREACH(hist->after, layer) {
+        size += sizeof(*layer);
+        if (layer->mesh)
+            size += sizeof(*layer->mesh) + mesh_get_blocks_size(layer->mesh);
+    }
+    DL_FOREACH(hist->before, layer) {
+        size += sizeof(*layer);
+        if (!layer->mesh) continue;
+        size += sizeof(*layer->mesh) + mesh_get_blocks_size(layer->mesh);
+        DL_FOREACH(layer->mesh->blocks, block) {
+            if (block->data->id == 0) continue; // Global empty data.
+            if (image_uses_data(img, block)) continue;
+            if (ptr_set_add(&datas, block->data))
+                size += sizeof(*block->data);
+        }
+    }
+    ptr_set_clear(&datas);
+    return size;
+}
+
+long image_get_history_size(const image_t *img, int *nb)
+{
+    const history_t *hist;
+    long size = 0;
+    if (nb) *nb = 0;
+    DL_FOREACH(img->history, hist) {
+        size += hist->size;
+        if (nb) (*nb)++;
+    }
+    return size;
+}
+
+// Delete the oldest entries until we fit in the budget.
+static void history_apply_budget(image_t *img)
+{
+    history_t *oldest;
+    layer_t *layer;
+    long size, budget = core()->history_budget;
+    if (!budget) return;
+    size = image_get_history_size(img, NULL);
+    while (size > budget) {
+        oldest = img->history->prev;
+        if (oldest == img->history_current) break;
+        LOG_D("Delete history entry (%ld bytes)", oldest->size);
+        size -= oldest->size;
+        DL_DELETE(img->history, oldest);
+        history_delete(oldest);
+        // The new oldest entry won't be undone anymore.
+        oldest = img->history->prev;
+        size -= oldest->size;
+        DL_FOREACH(oldest->before, layer) {
+            mesh_delete(layer->mesh);
+            layer->mesh = NULL;
+        }
+        oldest->size = history_get_size(oldest, img);
+        size += oldest->size;
+    }
+}
+
+// Move the entries more than history_in_memory steps away from the
+// current one to the scratch file.
+static void history_apply_spill(image_t *img)
+{
+    history_t *hist;
+    int i = 0, current = 0, n = core()->history_in_memory;
+    if (!n) return;
+    DL_FOREACH(img->history, hist) {
+        if (hist == img->history_current) break;
+        current++;
+    }
+    DL_FOREACH(img->history, hist) {
+        if (abs(i++ - current) <= n || hist->spilled) continue;
+        if (history_spill(hist, &img->history_scratch) != 0) break;
+        hist->size = history_get_size(hist, img);
     }
 }
 
 void image_history_push(image_t *img)
 {
-    image_t *snap = image_copy(img);
-    if (!img->history_current) img->history_current = img->history;
+    history_t *hist, *tmp;
+    hist = history_new(img->history_base, img);
+    if (img->history && history_is_empty(hist)) {
+        history_delete(hist);
+        return;
+    }
     // Discard previous undo.
-    while (img->history != img->history_current)
-        DL_DELETE2(img->history, img->history, history_prev, history_next);
-    DL_PREPEND2(img->history, snap, history_prev, history_next);
-    img->history_current = img->history;
+    while (img->history != img->history_current) {
+        tmp = img->history;
+        DL_DELETE(img->history, tmp);
+        history_delete(tmp);
+    }
+    hist->size = history_get_size(hist, img);
+    DL_PREPEND(img->history, hist);
+    img->history_current = hist;
+    image_delete(img->history_base);
+    img->history_base = image_copy(img);
+    if (img->journal) journal_add(img->journal, hist, false);
+    history_apply_spill(img);
+    history_apply_budget(img);
     print_history(img);
 }
 
-void image_undo(image_t *img)
+// Undo or redo an entry.  Any change since the last push is discarded.
+static bool history_move(image_t *img, history_t *hist, bool undo,
+                         mesh_t *changes)
+{
+    history_t *current;
+    if (hist->spilled) {
+        if (history_unspill(hist, img->history_scratch) != 0) return false;
+        hist->size = history_get_size(hist, img);
+    }
+    current = history_new(img->history_base, img);
+    history_apply(img, current, true, changes);
+    history_delete(current);
+    history_apply(img, hist, undo, changes);
+    image_delete(img->history_base);
+    img->history_base = image_copy(img);
+    return true;
+}
+
+void image_apply_history(image_t *img, const history_t *hist)
+{
+    const layer_t *layer;
+    history_apply(img, hist, false, NULL);
+    DL_FOREACH(img->layers, layer)
+        img->layers_next_id = max(img->layers_next_id, layer->id);
+}
+
+void image_undo(image_t *img, mesh_t *changes)
 {
-    if (!img->history_current->history_next) return;
-    img->history_current = img->history_current->history_next;
-    image_set(img, img->history_current);
-    goxel_update_meshes(goxel(), true);
+    history_t *hist = img->history_current;
+    if (!hist || !hist->next) return;
+    if (!history_move(img, hist, true, changes)) return;
+    img->history_current = hist->next;
+    if (img->journal) journal_add(img->journal, hist, true);
+    history_apply_spill(img);
     print_history(img);
 }
 
-void image_redo(image_t *img)
+void image_redo(image_t *img, mesh_t *changes)
 {
-    image_t *cur = img->history_current;
-    if (!cur || cur == img->history) return;
-    img->history_current = cur->history_prev;
-    image_set(img, img->history_current);
-    goxel_update_meshes(goxel(), true);
+    history_t *hist = img->history_current;
+    if (!hist || hist == img->history) return;
+    if (!history_move(img, hist->prev, false, changes)) return;
+    img->history_current = hist->prev;
+    if (img->journal) journal_add(img->journal, hist->prev, false);
+    history_apply_spill(img);
     print_history(img);
 }
@@ -26,6 +26,16 @@ void on_scroll(GLFWwindow *win, double x, double y)
     g_inputs->mouse_wheel = y;
 }
 
+void on_cursor_pos(GLFWwindow *win, double x, double y)
+{
+    int n = g_inputs->nb_mouse_samples;
+    // If we get too many positions, we keep replacing the last one.
+    if (n < 0 || n >= ARRAY_SIZE(g_inputs->mouse_samples))
+        n = ARRAY_SIZE(g_inputs->mouse_samples) - 1;
+    g_inputs->mouse_samples[n] = vec2(x, y);
+    g_inputs->nb_mouse_samples = n + 1;
+}
+
 void on_char(GLFWwindow *win, unsigned int c)
 {
     int i;
@@ -123,6 +133,110 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
 
 /* Our argp parser. */
 static struct argp argp = { options, parse_opt, args_doc, doc };
+
+/*
+ * goxel convert [OPTION...] IN OUT
+ * goxel convert [OPTION...] -f FORMAT IN...
+ *
+ * Batch conversion without opening any window.
+ */
+typedef struct
+{
+    int         nb_threads;
+    const char  *format;
+    int         mode;
+    char        **files;
+    int         nb_files;
+} convert_args_t;
+
+static char convert_doc[] = "Convert goxel files without opening a window.\n"
+    "The output format is given by the OUT extension (obj, ply, stl, glb), "
+    "or with --format, in which case each IN is converted to a file of the "
+    "same name with the new extension.";
+static char convert_args_doc[] = "IN OUT\n-f FORMAT IN...";
+#define OPT_SMOOTH 1
+#define OPT_MERGE 2
+static struct argp_option convert_options[] = {
+    {"threads", 't', "N", 0, "Number of threads (default: all the cpus)" },
+    {"format", 'f', "FORMAT", 0, "Output format for all the inputs" },
+    {"smooth", OPT_SMOOTH, NULL, 0, "Export a smooth surface" },
+    {"merge", OPT_MERGE, NULL, 0, "Merge the coplanar faces" },
+    { 0 }
+};
+
+static error_t convert_parse_opt(int key, char *arg, struct argp_state *state)
+{
+    convert_args_t *args = state->input;
+
+    switch (key)
+    {
+    case 't':
+        args->nb_threads = atoi(arg);
+        if (args->nb_threads <= 0)
+            argp_error(state, "invalid number of threads: %s", arg);
+        break;
+    case 'f':
+        args->format = arg;
+        break;
+    case OPT_SMOOTH:
+        args->mode = EXPORT_SMOOTH;
+        break;
+    case OPT_MERGE:
+        args->mode = EXPORT_CUBES_MERGED;
+        break;
+    case ARGP_KEY_ARGS:
+        args->files = state->argv + state->next;
+        args->nb_files = state->argc - state->next;
+        break;
+    case ARGP_KEY_END:
+        if (args->format ? args->nb_files < 1 : args->nb_files != 2)
+            argp_usage(state);
+        break;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp convert_argp = {
+    convert_options, convert_parse_opt, convert_args_doc, convert_doc };
+
+static int convert_main(int argc, char **argv)
+{
+    convert_args_t args = {};
+    const char **inputs, **outputs;
+    core_t core;
+    const char *ext, *sep;
+    int i, ret;
+
+    argv[0] = "goxel convert"; // For the usage messages.
+    argp_parse(&convert_argp, argc, argv, 0, 0, &args);
+    core_init(&core);
+    inputs = calloc(args.nb_files, sizeof(*inputs));
+    outputs = calloc(args.nb_files, sizeof(*outputs));
+    if (!args.format) {
+        inputs[0] = args.files[0];
+        outputs[0] = args.files[1];
+        args.nb_files = 1;
+    } else {
+        for (i = 0; i < args.nb_files; i++) {
+            inputs[i] = args.files[i];
+            ext = strrchr(inputs[i], '.');
+            sep = strrchr(inputs[i], '/');
+            if (!ext || (sep && sep > ext)) ext = inputs[i] + strlen(inputs[i]);
+            asprintf((char**)&outputs[i], "%.*s.%s", (int)(ext - inputs[i]),
+                     inputs[i], args.format);
+        }
+    }
+    ret = goxel_convert(inputs, outputs, args.nb_files, args.nb_threads,
+                        args.mode);
+    if (args.format) {
+        for (i = 0; i < args.nb_files; i++) free((char*)outputs[i]);
+    }
+    free(inputs);
+    free(outputs);
+    return ret ? EXIT_FAILURE : EXIT_SUCCESS;
+}
 #endif
 
 int main(int argc, char **argv)
@@ -130,7 +244,9 @@ int main(int argc, char **argv)
     args_t args = {};
     GLFWwindow *window;
     goxel_t goxel;
-    inputs_t inputs;
+    // Initialized here since the GLFW callbacks can write to it before
+    // the first iteration.
+    inputs_t inputs = {};
     g_inputs = &inputs;
     int w = 640;
     int h = 480;
@@ -138,6 +254,10 @@ int main(int argc, char **argv)
     double xpos, ypos;
 
 #ifndef WIN32
+    // The convert command runs before any GLFW call, so that it works
+    // without a display.
+    if (argc > 1 && strcmp(argv[1], "convert") == 0)
+        return convert_main(argc - 1, argv + 1);
     argp_parse (&argp, argc, argv, 0, 0, &args);
 #endif
 
@@ -148,12 +268,14 @@ int main(int argc, char **argv)
     glfwMakeContextCurrent(window);
     glfwSetScrollCallback(window, on_scroll);
     glfwSetCharCallback(window, on_char);
+    glfwSetCursorPosCallback(window, on_cursor_pos);
     glfwSetInputMode(window, GLFW_STICKY_MOUSE_BUTTONS, false);
 #ifdef WIN32
     glewInit();
 #endif
 
     goxel_init(&goxel);
+    if (!args.icons) journal_recover(&goxel, !args.args[0]);
     if (args.args[0])
         load_from_file(&goxel, args.args[0]);
     if (args.icons) {
@@ -184,6 +306,7 @@ int main(int argc, char **argv)
         glfwSwapBuffers(window);
         glfwPollEvents();
     }
+    journal_release();
     glfwTerminate();
     return 0;
 }
@@ -16,17 +16,64 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
 
-// Keep track of the last operation, so that it is fast to do it again.
-typedef struct {
+/*
+ * Cache of the last operations, so that it is fast to do them again, for
+ * example when the cube tool goes back to a previous box as the mouse
+ * jitters, or when the brush hovers over a position it already visited.
+ *
+ * The entries are kept in most recently used order, and the oldest ones are
+ * dropped when we get more than OPS_CACHE_MAX_NB of them, or when their
+ * results retain more than OPS_CACHE_MAX_SIZE bytes.
+ */
+typedef struct operation operation_t;
+struct operation {
+    operation_t *next, *prev;
     mesh_t      *origin;
     mesh_t      *result;
     painter_t   painter;
     box_t       box;
-} operation_t;
+    long        size;   // Memory retained by the result.
+};
+
+static const int  OPS_CACHE_MAX_NB = 32;
+static const long OPS_CACHE_MAX_SIZE = 64 << 20;
+
+static operation_t *g_ops = NULL;
+
+// Return the position of the block containing a point.
+static vec3_t get_block_pos(const vec3_t *p)
+{
+    const int N = BLOCK_SIZE;
+    return vec3(floor((p->x + N / 2) / N) * N,
+                floor((p->y + N / 2) / N) * N,
+                floor((p->z + N / 2) / N) * N);
+}
 
-static operation_t g_last_op= {};
+block_t *mesh_get_block_at(const mesh_t *mesh, const vec3_t *pos)
+{
+    block_t *block;
+    HASH_FIND(hh, mesh->index, pos, sizeof(*pos), block);
+    return block;
+}
+
+static void mesh_remove_block(mesh_t *mesh, block_t *block)
+{
+    DL_DELETE(mesh->blocks, block);
+    HASH_DEL(mesh->index, block);
+    block_delete(block);
+}
+
+// Delete a list of blocks and its index.
+static void blocks_delete(block_t *blocks, block_t *index)
+{
+    block_t *block, *tmp;
+    HASH_CLEAR(hh, index);
+    DL_FOREACH_SAFE(blocks, block, tmp) {
+        block_delete(block);
+    }
+}
 
 static void mesh_prepare_write(mesh_t *mesh)
 {
@@ -38,22 +85,36 @@ static void mesh_prepare_write(mesh_t *mesh)
     *mesh->ref = 1;
     blocks = mesh->blocks;
     mesh->blocks = NULL;
+    mesh->index = NULL;
     DL_FOREACH(blocks, block) {
         new_block = block_copy(block);
         new_block->id = block->id;
         DL_APPEND(mesh->blocks, new_block);
+        HASH_ADD(hh, mesh->index, pos, sizeof(new_block->pos), new_block);
     }
 }
 
+long mesh_get_blocks_size(const mesh_t *mesh)
+{
+    block_t *block;
+    long size = sizeof(*mesh->ref);
+    DL_FOREACH(mesh->blocks, block)
+        size += sizeof(*block);
+    // The hash handles are part of the blocks.
+    if (mesh->index) {
+        size += sizeof(UT_hash_table) +
+                mesh->index->hh.tbl->num_buckets * sizeof(UT_hash_bucket);
+    }
+    return size;
+}
+
 void mesh_remove_empty_blocks(mesh_t *mesh)
 {
     block_t *block, *tmp;
     mesh_prepare_write(mesh);
     DL_FOREACH_SAFE(mesh->blocks, block, tmp) {
-        if (block_is_empty(block, false)) {
-            DL_DELETE(mesh->blocks, block);
-            block_delete(block);
-        }
+        if (block_is_empty(block, false))
+            mesh_remove_block(mesh, block);
     }
 }
 
@@ -70,24 +131,19 @@ mesh_t *mesh_new(void)
 void mesh_clear(mesh_t *mesh)
 {
     assert(mesh);
-    block_t *block, *tmp;
     mesh_prepare_write(mesh);
-    DL_FOREACH_SAFE(mesh->blocks, block, tmp) {
-        block_delete(block);
-    }
+    blocks_delete(mesh->blocks, mesh->index);
     mesh->blocks = NULL;
+    mesh->index = NULL;
     mesh->next_block_id = 1;
 }
 
 void mesh_delete(mesh_t *mesh)
 {
-    block_t *block, *tmp;
     if (!mesh) return;
     (*mesh->ref)--;
     if (*mesh->ref == 0) {
-        DL_FOREACH_SAFE(mesh->blocks, block, tmp) {
-            block_delete(block);
-        }
+        blocks_delete(mesh->blocks, mesh->index);
         free(mesh->ref);
     }
     free(mesh);
@@ -97,15 +153,41 @@ mesh_t *mesh_copy(const mesh_t *other)
 {
     mesh_t *mesh = calloc(1, sizeof(*mesh));
     mesh->blocks = other->blocks;
+    mesh->index = other->index;
     mesh->ref = other->ref;
     mesh->next_block_id = other->next_block_id;
     (*mesh->ref)++;
     return mesh;
 }
 
+mesh_t *mesh_copy_box(const mesh_t *other, const box_t *box)
+{
+    mesh_t *mesh = mesh_new();
+    box_t bbox = box_get_bbox(*box);
+    const block_t *block;
+    vec3_t a, b, p;
+    float x, y, z;
+    const int s = BLOCK_SIZE;
+
+    // Only look at the positions inside the box, so that this does not
+    // depend on the size of the mesh.
+    a = vec3(bbox.p.x - bbox.w.x, bbox.p.y - bbox.h.y, bbox.p.z - bbox.d.z);
+    b = vec3(bbox.p.x + bbox.w.x, bbox.p.y + bbox.h.y, bbox.p.z + bbox.d.z);
+    a = get_block_pos(&a);
+    b = get_block_pos(&b);
+    for (z = a.z; z <= b.z; z += s)
+    for (y = a.y; y <= b.y; y += s)
+    for (x = a.x; x <= b.x; x += s)
+    {
+        p = vec3(x, y, z);
+        block = mesh_get_block_at(other, &p);
+        if (block) mesh_add_block(mesh, block->data, &p);
+    }
+    return mesh;
+}
+
 void mesh_set(mesh_t **mesh, const mesh_t *other)
 {
-    block_t *block, *tmp;
     mesh_t *m;
     assert(other);
     if (!*mesh) {
@@ -116,12 +198,11 @@ void mesh_set(mesh_t **mesh, const mesh_t *other)
     if (m->blocks == other->blocks) return; // Already the same.
     (*m->ref)--;
     if (*m->ref == 0) {
-        DL_FOREACH_SAFE(m->blocks, block, tmp) {
-            block_delete(block);
-        }
+        blocks_delete(m->blocks, m->index);
         free(m->ref);
     }
     m->blocks = other->blocks;
+    m->index = other->index;
     m->ref = other->ref;
     m->next_block_id = other->next_block_id;
     (*m->ref)++;
@@ -156,74 +237,419 @@ static void add_blocks(mesh_t *mesh, box_t box)
 {
     vec3_t a, b;
     float x, y, z;
-    int i;
-    const int s = BLOCK_SIZE - 2;
+    const int s = BLOCK_SIZE;
     vec3_t p;
-    block_t *block;
 
     a = vec3(box.p.x - box.w.x, box.p.y - box.h.y, box.p.z - box.d.z);
     b = vec3(box.p.x + box.w.x, box.p.y + box.h.y, box.p.z + box.d.z);
-    for (i = 0; i < 3; i++) {
-        a.v[i] = nearbyint(a.v[i] / s) * s;
-        b.v[i] = nearbyint(b.v[i] / s) * s;
-    }
-    // Inefficient algo.
+    a = get_block_pos(&a);
+    b = get_block_pos(&b);
     for (z = a.z; z <= b.z; z += s)
     for (y = a.y; y <= b.y; y += s)
     for (x = a.x; x <= b.x; x += s)
     {
         p = vec3(x, y, z);
-        DL_FOREACH(mesh->blocks, block) {
-            if (vec3_equal(block->pos, p)) break;
-        }
-        if (!block)
+        if (!mesh_get_block_at(mesh, &p))
             mesh_add_block(mesh, NULL, &p);
     }
 }
 
-void mesh_op(mesh_t *mesh, painter_t *painter, const box_t *box)
+/*
+ * Blocks that an operation with a rotated box can change.
+ *
+ * The bounding box of a rotated box can be much bigger than the box, for
+ * example with the laser tool beam seen from a diagonal, so we only keep the
+ * blocks that intersect the box.  For long and thin boxes, we find them by
+ * walking the blocks grid along the box axis (3D DDA) instead of looking at
+ * all the positions of the bounding box, so that the cost is proportional
+ * to the length of the box.
+ */
+
+// Check if a block intersects a box, with the separating axis test on the
+// axes of the block and of the box.  This can return false positives.
+static bool box_intersect_block(const box_t *box, const vec3_t *pos)
 {
-    // In case we are doing the same operation as last time, we can just use
-    // the value we buffered.
+    const float n = BLOCK_SIZE / 2.0;
+    const vec3_t axes[3] = {box->w, box->h, box->d};
+    const vec3_t d = vec3_sub(*pos, box->p);
+    vec3_t u;
+    float r, len;
+    int i, j;
+
+    for (i = 0; i < 3; i++) {
+        r = n;
+        for (j = 0; j < 3; j++) r += fabs(axes[j].v[i]);
+        if (fabs(d.v[i]) > r) return false;
+    }
+    for (i = 0; i < 3; i++) {
+        len = vec3_norm(axes[i]);
+        if (len == 0) continue;
+        u = vec3_mul(axes[i], 1 / len);
+        r = len + n * (fabs(u.x) + fabs(u.y) + fabs(u.z));
+        if (fabs(vec3_dot(d, u)) > r) return false;
+    }
+    return true;
+}
+
+// Get the box containing all the voxels an operation can change: the box
+// grown by one voxel, and for the rotated boxes also by the smoothed border
+// of the sphere and cylinder shapes, that can go up to sqrt(1 + 1 / s.x)
+// times the box size.
+static box_t get_op_box(const box_t *box)
+{
+    box_t ret = *box;
+    vec3_t *axes[3] = {&ret.w, &ret.h, &ret.d};
+    float lens[3], f = 1;
+    int i;
+
+    if (box_is_bbox(*box)) return bbox_grow(*box, 1, 1, 1);
+    for (i = 0; i < 3; i++) lens[i] = vec3_norm(*axes[i]);
+    if (min(lens[0], min(lens[1], lens[2])) > 0)
+        f = sqrt(1 + 1 / min(lens[0], min(lens[1], lens[2])));
+    for (i = 0; i < 3; i++) {
+        if (lens[i] == 0) continue;
+        *axes[i] = vec3_mul(*axes[i], (lens[i] * f + 1) / lens[i]);
+    }
+    return ret;
+}
+
+static void add_position(mesh_t *positions, const box_t *box,
+                         const vec3_t *pos)
+{
+    if (mesh_get_block_at(positions, pos)) return;
+    if (!box_intersect_block(box, pos)) return;
+    mesh_add_block(positions, NULL, pos);
+}
+
+// Return a mesh with an empty block at the positions of the blocks that
+// intersect a box.
+static mesh_t *get_box_positions(const box_t *box)
+{
+    const int s = BLOCK_SIZE;
+    mesh_t *positions = mesh_new();
+    const box_t b = *box;
+    const vec3_t *axes[3] = {&b.w, &b.h, &b.d};
+    box_t bbox;
+    vec3_t p0, p1, dir, p;
+    float lens[3], r = 0, border, tmax[3], tdelta[3];
+    int i, axis = 0, k, x, y, z, cell[3], end[3], step[3];
+    long nb_bbox = 1, nb_dda = 1;
+
+    for (i = 0; i < 3; i++) {
+        lens[i] = vec3_norm(*axes[i]);
+        if (lens[i] > lens[axis]) axis = i;
+    }
+    for (i = 0; i < 3; i++)
+        if (i != axis) r += lens[i] * lens[i];
+    k = ceil(sqrt(r) / s);
+    p0 = vec3_sub(b.p, *axes[axis]);
+    p1 = vec3_add(b.p, *axes[axis]);
+    dir = vec3_sub(p1, p0);
+    bbox = box_get_bbox(b);
+
+    // Estimate the number of positions we would check both ways.
+    for (i = 0; i < 3; i++) {
+        nb_bbox *= 2 * fabs(bbox.mat.vecs[i].v[i]) / s + 2;
+        nb_dda += fabs(dir.v[i]) / s + 1;
+    }
+    nb_dda *= (2 * k + 1) * (2 * k + 1) * (2 * k + 1);
+
+    if (nb_bbox <= nb_dda) {
+        p0 = vec3(bbox.p.x - bbox.w.x, bbox.p.y - bbox.h.y,
+                  bbox.p.z - bbox.d.z);
+        p1 = vec3(bbox.p.x + bbox.w.x, bbox.p.y + bbox.h.y,
+                  bbox.p.z + bbox.d.z);
+        p0 = get_block_pos(&p0);
+        p1 = get_block_pos(&p1);
+        for (p.z = p0.z - s; p.z <= p1.z + s; p.z += s)
+        for (p.y = p0.y - s; p.y <= p1.y + s; p.y += s)
+        for (p.x = p0.x - s; p.x <= p1.x + s; p.x += s)
+            add_position(positions, &b, &p);
+        return positions;
+    }
+
+    for (i = 0; i < 3; i++) {
+        cell[i] = floor((p0.v[i] + s / 2) / s);
+        end[i] = floor((p1.v[i] + s / 2) / s);
+        step[i] = dir.v[i] > 0 ? 1 : -1;
+        if (dir.v[i] == 0) {
+            tmax[i] = tdelta[i] = FLT_MAX;
+            continue;
+        }
+        border = (cell[i] + (step[i] > 0 ? 1 : 0)) * s - s / 2;
+        tmax[i] = (border - p0.v[i]) / dir.v[i];
+        tdelta[i] = s / fabs(dir.v[i]);
+    }
+    while (true) {
+        // All the blocks within the box section around the axis.
+        for (z = -k; z <= k; z++)
+        for (y = -k; y <= k; y++)
+        for (x = -k; x <= k; x++) {
+            p = vec3((cell[0] + x) * s, (cell[1] + y) * s, (cell[2] + z) * s);
+            add_position(positions, &b, &p);
+        }
+        if (cell[0] == end[0] && cell[1] == end[1] && cell[2] == end[2])
+            break;
+        i = (tmax[0] < tmax[1]) ? (tmax[0] < tmax[2] ? 0 : 2) :
+                                  (tmax[1] < tmax[2] ? 1 : 2);
+        if (tmax[i] > 1) break;
+        cell[i] += step[i];
+        tmax[i] += tdelta[i];
+    }
+    return positions;
+}
+
+static operation_t *ops_cache_find(const mesh_t *mesh,
+                                   const painter_t *painter,
+                                   const box_t *box)
+{
+    operation_t *op;
     #define EQUAL(a, b) (memcmp(&(a), &(b), sizeof(a)) == 0)
-    if (    g_last_op.origin &&
-            mesh->blocks == g_last_op.origin->blocks &&
-            EQUAL(*painter, g_last_op.painter) &&
-            EQUAL(*box, g_last_op.box)) {
-        mesh_set(&mesh, g_last_op.result);
-        return;
+    DL_FOREACH(g_ops, op) {
+        if (    mesh->blocks == op->origin->blocks &&
+                EQUAL(*painter, op->painter) &&
+                EQUAL(*box, op->box))
+            return op;
     }
     #undef EQUAL
-    mesh_set(&g_last_op.origin, mesh);
-    g_last_op.painter   = *painter;
-    g_last_op.box       = *box;
+    return NULL;
+}
+
+static void ops_cache_add(const mesh_t *origin, const mesh_t *result,
+                          const painter_t *painter, const box_t *box,
+                          long size)
+{
+    operation_t *op, *tmp;
+    int nb = 0;
+    long total = 0;
+
+    op = calloc(1, sizeof(*op));
+    op->origin = mesh_copy(origin);
+    op->result = mesh_copy(result);
+    op->painter = *painter;
+    op->box = *box;
+    op->size = size;
+    DL_PREPEND(g_ops, op);
+    DL_FOREACH_SAFE(g_ops, op, tmp) {
+        nb++;
+        total += op->size;
+        if (op == g_ops) continue; // Always keep the new one.
+        if (nb <= OPS_CACHE_MAX_NB && total <= OPS_CACHE_MAX_SIZE) continue;
+        total -= op->size;
+        DL_DELETE(g_ops, op);
+        mesh_delete(op->origin);
+        mesh_delete(op->result);
+        free(op);
+    }
+    PROFILER_COUNTER_SET("mesh op cache bytes", total);
+}
 
-    box_t bbox = bbox_grow(box_get_bbox(*box), 1, 1, 1);
+static void mesh_op_(mesh_t *mesh, painter_t *painter, const box_t *box,
+                     bool use_cache)
+{
+    operation_t *op;
+    mesh_t *origin = NULL, *positions;
+    box_t bbox, op_box;
     block_t *block, *tmp;
+    const block_t *pos;
+    int nb = 0;
+
+    // In case we are doing an operation we did recently, we can just use
+    // the value we buffered.
+    if (use_cache) {
+        op = ops_cache_find(mesh, painter, box);
+        if (op) {
+            PROFILER_COUNTER_ADD("mesh op cache hits", 1);
+            DL_DELETE(g_ops, op);
+            DL_PREPEND(g_ops, op);
+            mesh_set(&mesh, op->result);
+            return;
+        }
+        PROFILER_COUNTER_ADD("mesh op cache misses", 1);
+        origin = mesh_copy(mesh);
+    }
+
+    bbox = bbox_grow(box_get_bbox(*box), 1, 1, 1);
+    mesh_prepare_write(mesh);
+    if (!box_is_bbox(*box)) {
+        // Only visit the blocks that intersect the box.
+        op_box = get_op_box(box);
+        positions = get_box_positions(&op_box);
+        DL_FOREACH(positions->blocks, pos) {
+            block = mesh_get_block_at(mesh, &pos->pos);
+            if (!block) {
+                if (painter->op != OP_ADD) continue;
+                mesh_add_block(mesh, NULL, &pos->pos);
+                block = mesh_get_block_at(mesh, &pos->pos);
+            }
+            block_op(block, painter, box);
+            if (block_is_empty(block, true))
+                mesh_remove_block(mesh, block);
+            else
+                nb++;
+        }
+        mesh_delete(positions);
+        goto end;
+    }
     // In case of an add operation, we have to add blocks if they are not
     // there yet.
-    mesh_prepare_write(mesh);
     if (painter->op == OP_ADD) {
         add_blocks(mesh, bbox);
     }
     DL_FOREACH_SAFE(mesh->blocks, block, tmp) {
         if (!bbox_intersect(bbox, block_get_box(block, false))) continue;
         block_op(block, painter, box);
-        if (block_is_empty(block, true)) {
-            DL_DELETE(mesh->blocks, block);
-            block_delete(block);
-        }
+        if (block_is_empty(block, true))
+            mesh_remove_block(mesh, block);
+        else
+            nb++;
     }
-    mesh_set(&g_last_op.result, mesh);
+end:
+    if (!use_cache) return;
+    // The modified blocks are only retained by the result, at worst.
+    ops_cache_add(origin, mesh, painter, box,
+                  mesh_get_blocks_size(mesh) + nb * sizeof(block_data_t));
+    mesh_delete(origin);
 }
 
-static block_t *mesh_get_block_at(const mesh_t *mesh, const vec3_t *pos)
+void mesh_op(mesh_t *mesh, painter_t *painter, const box_t *box)
+{
+    mesh_op_(mesh, painter, box, true);
+}
+
+void mesh_op_nocache(mesh_t *mesh, painter_t *painter, const box_t *box)
+{
+    mesh_op_(mesh, painter, box, false);
+}
+
+// Check if a block is fully inside a box, in which case the cube shape sets
+// all its voxels.
+static bool box_contains_block(const box_t *box, const vec3_t *pos)
+{
+    const float n = BLOCK_SIZE / 2.0;
+    mat4_t mat = box->mat;
+    vec3_t p;
+    int i;
+    if (!mat4_invert(&mat)) return false;
+    for (i = 0; i < 8; i++) {
+        p = vec3(pos->x + (i & 1 ? n : -n),
+                 pos->y + (i & 2 ? n : -n),
+                 pos->z + (i & 4 ? n : -n));
+        p = mat4_mul_vec3(mat, p);
+        if (fabs(p.x) >= 1 || fabs(p.y) >= 1 || fabs(p.z) >= 1) return false;
+    }
+    return true;
+}
+
+// Check if the cube shape sets the same voxels of a block with two boxes.
+// This can return false negatives.
+static bool cube_same_voxels(const box_t *a, const box_t *b, const vec3_t *pos)
 {
+    const float n = BLOCK_SIZE / 2.0;
+    float a0, a1, b0, b1, ea, eb;
+    bool a_empty = false, b_empty = false, same = true;
+    int i;
+
+    if (box_contains_block(a, pos) && box_contains_block(b, pos)) return true;
+    if (!box_is_bbox(*a) || !box_is_bbox(*b)) return false;
+    for (i = 0; i < 3; i++) {
+        ea = fabs(a->mat.vecs[i].v[i]);
+        eb = fabs(b->mat.vecs[i].v[i]);
+        a0 = max(a->p.v[i] - ea, pos->v[i] - n);
+        a1 = min(a->p.v[i] + ea, pos->v[i] + n);
+        b0 = max(b->p.v[i] - eb, pos->v[i] - n);
+        b1 = min(b->p.v[i] + eb, pos->v[i] + n);
+        if (a0 >= a1) a_empty = true;
+        if (b0 >= b1) b_empty = true;
+        if (a0 != b0 || a1 != b1) same = false;
+        // Don't try to guess the rounding of the limits on a voxel center.
+        if (fabs(a0 - floor(a0) - 0.5) < 0.01) same = false;
+        if (fabs(a1 - floor(a1) - 0.5) < 0.01) same = false;
+    }
+    return (a_empty && b_empty) || same;
+}
+
+// Set the block of a mesh at a given position back to the one of an other
+// mesh, and return it.
+static block_t *restore_block(mesh_t *mesh, const mesh_t *other,
+                              const vec3_t *pos)
+{
+    block_t *block = mesh_get_block_at(mesh, pos);
+    const block_t *other_block = mesh_get_block_at(other, pos);
+    if (!other_block) {
+        if (block) mesh_remove_block(mesh, block);
+        return NULL;
+    }
+    if (!block) {
+        mesh_add_block(mesh, other_block->data, pos);
+        return mesh_get_block_at(mesh, pos);
+    }
+    if (block->data != other_block->data)
+        block_set_data(block, other_block->data);
+    return block;
+}
+
+void mesh_op_update(mesh_t *mesh, const mesh_t *origin, painter_t *painter,
+                    const box_t *box, const box_t *prev)
+{
+    box_t op_box, prev_op_box, bbox, prev_bbox, region;
     block_t *block;
-    DL_FOREACH(mesh->blocks, block) {
-        if (vec3_equal(block->pos, *pos)) return block;
+    vec3_t a, b, add_a, add_b, p;
+    float x, y, z;
+    const int s = BLOCK_SIZE;
+    const bool cube = painter->shape == &shape_cube;
+
+    if (memcmp(box, prev, sizeof(*box)) == 0) return;
+    op_box = get_op_box(box);
+    prev_op_box = get_op_box(prev);
+    bbox = box_get_bbox(op_box);
+    prev_bbox = box_get_bbox(prev_op_box);
+    mesh_prepare_write(mesh);
+
+    // Same as add_blocks, mesh_op only uses it for the non rotated boxes.
+    add_a = vec3(bbox.p.x - bbox.w.x, bbox.p.y - bbox.h.y, bbox.p.z - bbox.d.z);
+    add_b = vec3(bbox.p.x + bbox.w.x, bbox.p.y + bbox.h.y, bbox.p.z + bbox.d.z);
+    add_a = get_block_pos(&add_a);
+    add_b = get_block_pos(&add_b);
+
+    // Only look at the positions around the two boxes, so that this does not
+    // depend on the size of the mesh.  mesh_op also modifies the blocks that
+    // only touch the box, so we add a margin of one block.
+    region = bbox_grow(bbox_merge(bbox, prev_bbox), s, s, s);
+    a = vec3(region.p.x - region.w.x, region.p.y - region.h.y,
+             region.p.z - region.d.z);
+    b = vec3(region.p.x + region.w.x, region.p.y + region.h.y,
+             region.p.z + region.d.z);
+    a = get_block_pos(&a);
+    b = get_block_pos(&b);
+    for (z = a.z; z <= b.z; z += s)
+    for (y = a.y; y <= b.y; y += s)
+    for (x = a.x; x <= b.x; x += s)
+    {
+        p = vec3(x, y, z);
+        if (!box_intersect_block(&op_box, &p)) {
+            if (box_intersect_block(&prev_op_box, &p))
+                restore_block(mesh, origin, &p);
+            continue;
+        }
+        // With the cube shape, the blocks where the two boxes set the same
+        // voxels don't change.  XXX: we could do the same for the other
+        // shapes with a way to test the inside of the shapes.
+        if (    cube && box_intersect_block(&prev_op_box, &p) &&
+                cube_same_voxels(box, prev, &p))
+            continue;
+        block = restore_block(mesh, origin, &p);
+        if (!block) {
+            if (painter->op != OP_ADD) continue;
+            if (    box_is_bbox(*box) && (x < add_a.x || y < add_a.y || z < add_a.z ||
+                    x > add_b.x || y > add_b.y || z > add_b.z)) continue;
+            mesh_add_block(mesh, NULL, &p);
+            block = mesh_get_block_at(mesh, &p);
+        }
+        block_op(block, painter, box);
+        if (block_is_empty(block, true))
+            mesh_remove_block(mesh, block);
     }
-    return NULL;
 }
 
 void mesh_merge(mesh_t *mesh, const mesh_t *other)
@@ -247,17 +673,58 @@ void mesh_merge(mesh_t *mesh, const mesh_t *other)
         other_block = mesh_get_block_at(other, &block->pos);
         if (    block_is_empty(block, true) &&
                 block_is_empty(other_block, true)) {
-            DL_DELETE(mesh->blocks, block);
-            block_delete(block);
+            mesh_remove_block(mesh, block);
             continue;
         }
         block_merge(block, other_block);
     }
 }
 
+// Data of a block, NULL for no block or the empty data.
+static const block_data_t *get_data(const block_t *block)
+{
+    return (block && block->data->id) ? block->data : NULL;
+}
+
+void mesh_diff(const mesh_t *a, const mesh_t *b,
+               mesh_t *a_out, mesh_t *b_out)
+{
+    block_t *block, *other;
+    if (a->blocks == b->blocks) return;
+    DL_FOREACH(b->blocks, block) {
+        other = mesh_get_block_at(a, &block->pos);
+        if (get_data(other) == get_data(block)) continue;
+        mesh_add_block(a_out, other ? other->data : NULL, &block->pos);
+        mesh_add_block(b_out, block->data, &block->pos);
+    }
+    DL_FOREACH(a->blocks, block) {
+        if (!get_data(block) || mesh_get_block_at(b, &block->pos)) continue;
+        mesh_add_block(a_out, block->data, &block->pos);
+        mesh_add_block(b_out, NULL, &block->pos);
+    }
+}
+
+void mesh_replace_blocks(mesh_t *mesh, const mesh_t *other)
+{
+    block_t *block, *other_block;
+    if (!other->blocks) return;
+    mesh_prepare_write(mesh);
+    DL_FOREACH(other->blocks, other_block) {
+        block = mesh_get_block_at(mesh, &other_block->pos);
+        if (block_is_empty(other_block, true)) {
+            if (block) mesh_remove_block(mesh, block);
+        } else if (block) {
+            block_set_data(block, other_block->data);
+        } else {
+            mesh_add_block(mesh, other_block->data, &other_block->pos);
+        }
+    }
+}
+
 void mesh_add_block(mesh_t *mesh, block_data_t *data, const vec3_t *pos)
 {
     block_t *block;
+    assert(vec3_equal(get_block_pos(pos), *pos));
     assert(!mesh_get_block_at(mesh, pos));
     mesh_prepare_write(mesh);
     DL_FOREACH(mesh->blocks, block)
@@ -265,16 +732,49 @@ void mesh_add_block(mesh_t *mesh, block_data_t *data, const vec3_t *pos)
     block = block_new(pos, data);
     block->id = mesh->next_block_id++;
     DL_APPEND(mesh->blocks, block);
+    HASH_ADD(hh, mesh->index, pos, sizeof(block->pos), block);
 }
 
 uvec4b_t mesh_get_at(const mesh_t *mesh, const vec3_t *pos)
 {
+    vec3_t block_pos = get_block_pos(pos);
+    block_t *block = mesh_get_block_at(mesh, &block_pos);
+    if (!block) return uvec4b(0, 0, 0, 0);
+    return block_get_at(block, pos);
+}
+
+void mesh_set_at(mesh_t *mesh, const vec3_t *pos, uvec4b_t v)
+{
+    vec3_t block_pos = get_block_pos(pos);
     block_t *block;
-    DL_FOREACH(mesh->blocks, block) {
-        if (bbox_contains_vec(block_get_box(block, false), *pos))
-            return block_get_at(block, pos);
+    mesh_prepare_write(mesh);
+    block = mesh_get_block_at(mesh, &block_pos);
+    if (!block) {
+        if (!v.a) return;
+        mesh_add_block(mesh, NULL, &block_pos);
+        block = mesh->blocks->prev;
+    }
+    block_set_at(block, pos, v);
+}
+
+// Get the data of the 3x3x3 blocks around a block, so that we can read the
+// voxels just outside of it.
+void mesh_get_neighbors(const mesh_t *mesh, const block_t *block,
+                        const block_data_t *neighbors[27])
+{
+    const int N = BLOCK_SIZE;
+    int x, y, z, i = 0;
+    vec3_t pos;
+    const block_t *other;
+    for (z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++) {
+        pos = vec3(block->pos.x + x * N,
+                   block->pos.y + y * N,
+                   block->pos.z + z * N);
+        other = (x || y || z) ? mesh_get_block_at(mesh, &pos) : block;
+        neighbors[i++] = other ? other->data : NULL;
     }
-    return uvec4b(0, 0, 0, 0);
 }
 
 typedef struct
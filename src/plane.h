@@ -16,7 +16,7 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
 
 /*  A plane is defined as the 4x4 matrix to transform from the plane local
  *  coordinate into global coordinates:
@@ -16,13 +16,18 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
+#include <pthread.h>
 #include <time.h>
 
+// The profiler is not thread safe, we only profile the thread that started
+// it.
+static pthread_t g_thread;
 static bool g_running = false;
 static profiler_block_t *g_blocks = NULL;
 static profiler_block_t *g_current_block = NULL;
 static profiler_block_t g_root_block = {"root"};
+static profiler_counter_t *g_counters = NULL;
 
 #ifndef __MACH__
 static int64_t get_clock(void)
@@ -52,6 +57,7 @@ void profiler_start(void)
         b->count = b->tot_time = b->self_time = b->depth = 0;
         LL_DELETE(g_blocks, b);
     }
+    g_thread = pthread_self();
     g_running = true;
 }
 
@@ -103,7 +109,7 @@ profiler_block_t *profiler_get_blocks()
 
 void profiler_enter_(profiler_block_t *block)
 {
-    if (!g_running) return;
+    if (!g_running || !pthread_equal(pthread_self(), g_thread)) return;
     if (!block->depth && !block->count) {
         LL_APPEND(g_blocks, block);
     }
@@ -115,7 +121,7 @@ void profiler_enter_(profiler_block_t *block)
 
 void profiler_exit_(profiler_block_t *block)
 {
-    if (!g_running) return;
+    if (!g_running || !pthread_equal(pthread_self(), g_thread)) return;
     int64_t time;
     block->depth--;
     if (block->depth) return;
@@ -127,3 +133,27 @@ void profiler_exit_(profiler_block_t *block)
         block->parent->self_time -= time;
     g_current_block = block->parent;
 }
+
+static void counter_register(profiler_counter_t *counter)
+{
+    if (counter->registered) return;
+    counter->registered = true;
+    LL_APPEND(g_counters, counter);
+}
+
+void profiler_counter_set_(profiler_counter_t *counter, int64_t value)
+{
+    counter_register(counter);
+    counter->value = value;
+}
+
+void profiler_counter_add_(profiler_counter_t *counter, int64_t value)
+{
+    counter_register(counter);
+    counter->value += value;
+}
+
+profiler_counter_t *profiler_get_counters()
+{
+    return g_counters;
+}
@@ -40,8 +40,10 @@ enum {
     ITEM_GRID,
 };
 
+// The vertices of a block also depend on the border voxels of its
+// neighbors, so we use the ids of all the 3x3x3 blocks data around it.
 typedef struct {
-    int id;
+    uint64_t ids[27];
     int effects;
 } block_item_key_t;
 
@@ -56,6 +58,7 @@ struct render_item_t
         mesh_t          *mesh;
         mat4_t          mat;
     };
+    mesh_t          *overlay;
     vec3_t          grid;
     uvec4b_t        color;
     model3d_t       *model3d;
@@ -314,16 +317,48 @@ void render_deinit(void)
     index_buffer = 0;
 }
 
-static render_item_t *get_item_for_block(const block_t *block, int effects)
+// Get the data of the 3x3x3 blocks around a block, where the blocks of the
+// overlay, if any, replace the blocks of the mesh.
+static void get_neighbors(const mesh_t *mesh, const mesh_t *overlay,
+                          const block_t *block,
+                          const block_data_t *neighbors[27])
+{
+    int x, y, z, i = 0;
+    vec3_t pos;
+    const block_t *other;
+    if (!overlay) {
+        mesh_get_neighbors(mesh, block, neighbors);
+        return;
+    }
+    for (z = -1; z <= 1; z++)
+    for (y = -1; y <= 1; y++)
+    for (x = -1; x <= 1; x++) {
+        pos = vec3(block->pos.x + x * BLOCK_SIZE,
+                   block->pos.y + y * BLOCK_SIZE,
+                   block->pos.z + z * BLOCK_SIZE);
+        other = (x || y || z) ? mesh_get_block_at(overlay, &pos) : block;
+        if (!other) other = mesh_get_block_at(mesh, &pos);
+        neighbors[i++] = other ? other->data : NULL;
+    }
+}
+
+static render_item_t *get_item_for_block(const mesh_t *mesh,
+                                         const mesh_t *overlay,
+                                         const block_t *block, int effects)
 {
     voxel_vertex_t* vertices;
     render_item_t *item;
+    const block_data_t *neighbors[27];
+    int i;
     // For the moment no effects affect the item vertice array.
     const int effects_mask = EFFECT_BORDERS | EFFECT_BORDERS_ALL;
-    block_item_key_t key = {
-        .id = block->data->id,
-        .effects = effects & effects_mask,
-    };
+    block_item_key_t key;
+    // The key is hashed as raw bytes, so we also clear the padding.
+    memset(&key, 0, sizeof(key));
+    key.effects = effects & effects_mask;
+    get_neighbors(mesh, overlay, block, neighbors);
+    for (i = 0; i < 27; i++)
+        key.ids[i] = neighbors[i] ? neighbors[i]->id : 0;
     HASH_FIND(hh, g_items, &key, sizeof(key), item);
     if (item) goto end;
 
@@ -334,7 +369,7 @@ static render_item_t *get_item_for_block(const block_t *block, int effects)
     // XXX: can we avoid this big alloc?
     vertices = calloc(BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE * 6 * 4,
                       sizeof(*vertices));
-    item->nb_quads = block_generate_vertices(block->data, effects, vertices);
+    item->nb_quads = block_generate_vertices(neighbors, effects, vertices);
     if (item->nb_quads > BATCH_QUAD_COUNT) {
         LOG_W("Too many quads!");
         item->nb_quads = BATCH_QUAD_COUNT;
@@ -351,7 +386,8 @@ end:
     return item;
 }
 
-static void render_block_(renderer_t *rend, block_t *block, int effects,
+static void render_block_(renderer_t *rend, const mesh_t *mesh,
+                          const mesh_t *overlay, block_t *block, int effects,
                           prog_t *prog, mat4_t *model)
 {
     render_item_t *item;
@@ -359,7 +395,7 @@ static void render_block_(renderer_t *rend, block_t *block, int effects,
     mat4_t block_model;
     int attr;
 
-    item = get_item_for_block(block, effects);
+    item = get_item_for_block(mesh, overlay, block, effects);
     if (item->nb_quads == 0) return;
     GL(glBindBuffer(GL_ARRAY_BUFFER, item->vertex_buffer));
 
@@ -388,8 +424,8 @@ static void render_block_(renderer_t *rend, block_t *block, int effects,
                       GL_UNSIGNED_SHORT, 0));
 }
 
-static void render_mesh_(renderer_t *rend, mesh_t *mesh, int effects,
-                         const mat4_t *view, const mat4_t *proj)
+static void render_mesh_(renderer_t *rend, mesh_t *mesh, mesh_t *overlay,
+                         int effects, const mat4_t *view, const mat4_t *proj)
 {
     prog_t *prog;
     block_t *block;
@@ -443,7 +479,12 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh, int effects,
     GL(glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer));
 
     DL_FOREACH(mesh->blocks, block) {
-        render_block_(rend, block, effects, prog, &model);
+        if (overlay && mesh_get_block_at(overlay, &block->pos)) continue;
+        render_block_(rend, mesh, overlay, block, effects, prog, &model);
+    }
+    if (overlay) {
+        DL_FOREACH(overlay->blocks, block)
+            render_block_(rend, mesh, overlay, block, effects, prog, &model);
     }
 
     for (attr = 0; attr < ARRAY_SIZE(ATTRIBUTES); attr++)
@@ -452,15 +493,22 @@ static void render_mesh_(renderer_t *rend, mesh_t *mesh, int effects,
     if (effects & EFFECT_SEE_BACK) {
         effects &= ~EFFECT_SEE_BACK;
         effects |= EFFECT_SEMI_TRANSPARENT;
-        render_mesh_(rend, mesh, effects, view, proj);
+        render_mesh_(rend, mesh, overlay, effects, view, proj);
     }
 }
 
 void render_mesh(renderer_t *rend, const mesh_t *mesh, int effects)
+{
+    render_mesh_overlay(rend, mesh, NULL, effects);
+}
+
+void render_mesh_overlay(renderer_t *rend, const mesh_t *mesh,
+                         const mesh_t *overlay, int effects)
 {
     render_item_t *item = calloc(1, sizeof(*item));
     item->type = ITEM_MESH;
     item->mesh = mesh_copy(mesh);
+    item->overlay = overlay ? mesh_copy(overlay) : NULL;
     item->effects = effects | rend->material.effects | EFFECT_SMOOTH;
     // With EFFECT_RENDER_POS we need to remove some effects.
     if (item->effects & EFFECT_RENDER_POS)
@@ -602,9 +650,11 @@ void render_render(renderer_t *rend, const mat4_t *view, const mat4_t *proj)
         item->last_used_frame = goxel()->frame_count;
         switch (item->type) {
         case ITEM_MESH:
-            render_mesh_(rend, item->mesh, item->effects, view, proj);
+            render_mesh_(rend, item->mesh, item->overlay, item->effects,
+                         view, proj);
             DL_DELETE(rend->items, item);
             mesh_delete(item->mesh);
+            mesh_delete(item->overlay);
             break;
         case ITEM_MODEL3D:
             render_model_item(rend, item, view, proj);
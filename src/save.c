@@ -17,21 +17,27 @@
  */
 
 
-#include "goxel.h"
+#include "core.h"
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef WIN32
+#   include <io.h>
+#endif
 
 /*
- * File format, version 1:
+ * File format, version 3:
  *
  * This is inspired by the png format, where the file consists of a list of
  * chunks with different types.
  *
  *  4 bytes magic string        : "GOX "
- *  4 bytes version             : 1
+ *  4 bytes version             : 3
  *  List of chunks:
  *      4 bytes: data length
  *      4 bytes: type
  *      n bytes: data
- *      4 bytes: CRC
+ *      4 bytes: CRC-32C of the type and data (0 in version 1 files)
  *
  *  The layer can end with a DICT:
  *      for each entry:
@@ -44,6 +50,11 @@
  *
  *  BL16: a 16^3 block saved as a 64x64 png image.
  *
+ *  Since version 3 the blocks positions are multiple of 16, and the blocks
+ *  don't overlap.  Before, the blocks were every 14 voxels, with a one
+ *  voxel shell duplicating the border voxels of their neighbors.  Those
+ *  files are converted when loaded.
+ *
  *  LAYR: a layer:
  *      4 bytes: number of blocks.
  *      for each block:
@@ -52,17 +63,72 @@
  *          4 bytes: y
  *          4 bytes: z
  *          4 bytes: 0
- *      [DICT]
+ *      [DICT]: name, id (4 bytes, used by the EDIT chunks).
+ *
+ *  LSET: start of a new set of layers.  All the layers read before this
+ *        chunk are discarded.  This is used by incremental saves, that only
+ *        append the new blocks and the new layers at the end of an existing
+ *        file.  The block indices keep counting from the beginning of the
+ *        file.
+ *      4 bytes: number of LAYR chunks in the set (at least one).
+ *        If the file ends before all the layers of the set, the save was
+ *        interrupted, and the previous set is used instead.
+ *
+ *  EDIT: a change of the layers, used by the journal (see save_gui.c).  The
+ *        chunk contains the new list of layers, with only the blocks that
+ *        changed:
+ *      4 bytes: active layer id
+ *      4 bytes: number of layers
+ *      for each layer:
+ *          4 bytes: id
+ *          4 bytes: visible
+ *          4 bytes: name size
+ *          n bytes: name
+ *          4 bytes: number of blocks
+ *          for each block:
+ *              4 bytes: x
+ *              4 bytes: y
+ *              4 bytes: z
+ *              4 bytes: png size (0 for an empty block)
+ *              n bytes: png data, as in BL16
  *
  */
 
+// When more than this fraction of the file is taken by chunks that are not
+// used anymore, we rewrite the whole file instead of appending to it.
+static const float MAX_DEAD_RATIO = 0.5;
+
+/*
+ * Blocks are deduplicated by the hash of their content, so that identical
+ * blocks coming from different operations are only saved once, and share
+ * the same data once loaded.
+ */
+
 // We create a hash table of all the blocks data.
 typedef struct {
     UT_hash_handle  hh;
     block_data_t    *v;
+    uint64_t        hash[2];
     int             index;
+    int             size;   // Size of the chunk in the file.
 } block_hash_t;
 
+// Blocks data that are already in the file, indexed by content hash.
+typedef struct {
+    UT_hash_handle  hh;
+    uint64_t        hash[2];
+    int             index;  // Index of the BL16 chunk in the file.
+    int             size;   // Size taken by the chunk in the file.
+    bool            used;
+} saved_block_t;
+
+struct save_state {
+    char            *path;
+    long            size;       // Size of the file after the last save.
+    int             nb_blocks;  // Number of BL16 chunks in the file.
+    saved_block_t   *blocks;
+};
+
 typedef struct {
     long     length_pos; // File position where we have to write the length.
     int      length;
@@ -70,6 +136,7 @@ typedef struct {
 
     int      pos;
     char     type[5];
+    bool     error;      // Set if we tried to read past the chunk data.
 } chunk_t;
 
 static void write_int32(FILE *out, int32_t v)
@@ -90,14 +157,21 @@ static bool chunk_read_start(chunk_t *c, FILE *in)
     fread(c->type, 4, 1, in);
     if (feof(in)) return false;
     c->length = read_int32(in);
+    c->crc = crc32c(0, c->type, 4);
+    if (c->length < 0) c->error = true;
     return true;
 }
 
 static void chunk_read(chunk_t *c, FILE *in, char *buff, int size)
 {
     c->pos += size;
-    assert(c->pos <= c->length);
-    fread(buff, size, 1, in);
+    if (c->error || c->pos > c->length ||
+            (size && fread(buff, size, 1, in) != 1)) {
+        c->error = true;
+        memset(buff, 0, size);
+        return;
+    }
+    c->crc = crc32c(c->crc, buff, size);
 }
 
 static int32_t chunk_read_int32(chunk_t *c, FILE *in)
@@ -107,26 +181,29 @@ static int32_t chunk_read_int32(chunk_t *c, FILE *in)
     return v;
 }
 
-static void chunk_read_finish(chunk_t *c, FILE *in)
+// Return false if the stored CRC does not match the chunk data.
+static bool chunk_read_finish(chunk_t *c, FILE *in)
 {
     assert(c->pos == c->length);
-    read_int32(in); // TODO: check crc.
+    return (uint32_t)read_int32(in) == c->crc;
 }
 
+// Return the value size, 0 at the end of the dict, or -1 on error.
 static int chunk_read_dict_value(chunk_t *c, FILE *in,
                                  char *key, char *value) {
     int size;
-    assert(c->pos <= c->length);
+    if (c->error) return -1;
     if (c->pos == c->length) return 0;
     size = chunk_read_int32(c, in);
     if (size == 0) return 0;
-    assert(size < 256);
+    if (size < 0 || size >= 256) return -1;
     chunk_read(c, in, key, size);
     key[size] = '\0';
     size = chunk_read_int32(c, in);
+    if (size < 0 || size >= 256) return -1;
     chunk_read(c, in, value, size);
     value[size] = '\0';
-    return size;
+    return c->error ? -1 : size;
 }
 
 static void chunk_write_start(chunk_t *c, FILE *out, const char *type)
@@ -136,12 +213,14 @@ static void chunk_write_start(chunk_t *c, FILE *out, const char *type)
     fwrite(type, 4, 1, out);
     c->length_pos = ftell(out);
     write_int32(out, 0); // Placeholder for the the length.
+    c->crc = crc32c(0, type, 4);
 }
 
 static void chunk_write(chunk_t *c, FILE *out, const char *data, int size)
 {
     fwrite(data, size, 1, out);
     c->length += size;
+    c->crc = crc32c(c->crc, data, size);
 }
 
 static void chunk_write_int32(chunk_t *c, FILE *out, int32_t v)
@@ -163,65 +242,208 @@ static void chunk_write_finish(chunk_t *c, FILE *out)
     fseek(out, c->length_pos, SEEK_SET);
     write_int32(out, c->length);
     fseek(out, 0, SEEK_END);
-    write_int32(out, 0);        // CRC XXX: todo.
+    write_int32(out, c->crc);
 }
 
+// Write a whole chunk without seeking back, so that it also works for
+// files open in append mode.
 static void chunk_write_all(FILE *out, const char *type,
                             const char *data, int size)
 {
-    chunk_t c;
-    chunk_write_start(&c, out, type);
-    chunk_write(&c, out, data, size);
-    chunk_write_finish(&c, out);
+    assert(strlen(type) == 4);
+    fwrite(type, 4, 1, out);
+    write_int32(out, size);
+    fwrite(data, size, 1, out);
+    write_int32(out, crc32c(crc32c(0, type, 4), data, size));
+}
+
+void save_state_delete(save_state_t *state)
+{
+    saved_block_t *saved, *tmp;
+    if (!state) return;
+    HASH_ITER(hh, state->blocks, saved, tmp) {
+        HASH_DEL(state->blocks, saved);
+        free(saved);
+    }
+    free(state->path);
+    free(state);
+}
+
+static save_state_t *save_state_new(const char *path)
+{
+    save_state_t *state = calloc(1, sizeof(*state));
+    state->path = strdup(path);
+    return state;
+}
+
+static saved_block_t *save_state_add(save_state_t *state,
+                                     const uint64_t hash[2],
+                                     int index, int size)
+{
+    saved_block_t *saved = calloc(1, sizeof(*saved));
+    memcpy(saved->hash, hash, sizeof(saved->hash));
+    saved->index = index;
+    saved->size = size;
+    HASH_ADD(hh, state->blocks, hash, sizeof(saved->hash), saved);
+    return saved;
+}
+
+static saved_block_t *save_state_find(const save_state_t *state,
+                                      const uint64_t hash[2])
+{
+    saved_block_t *saved;
+    HASH_FIND(hh, state->blocks, hash, sizeof(saved->hash), saved);
+    return saved;
+}
+
+// Check if we can append the modifications of the image to the file, or
+// if we need to write the whole file again.
+static bool can_append(const block_hash_t *blocks_table,
+                       save_state_t *state, const char *path)
+{
+    struct stat s;
+    saved_block_t *saved, *tmp;
+    const block_hash_t *data;
+    long used = 0;
+
+    if (!state || strcmp(state->path, path) != 0) return false;
+    if (str_endswith(path, ".gz")) return false;
+    // Make sure the file has not been modified by someone else.
+    if (stat(path, &s) != 0 || s.st_size != state->size) return false;
+
+    // Compute the size of the chunks that are still used by the image.
+    HASH_ITER(hh, state->blocks, saved, tmp)
+        saved->used = false;
+    for (data = blocks_table; data; data = data->hh.next) {
+        saved = save_state_find(state, data->hash);
+        if (saved) saved->used = true;
+    }
+    HASH_ITER(hh, state->blocks, saved, tmp) {
+        if (saved->used) used += saved->size;
+    }
+    return state->size - used <= state->size * MAX_DEAD_RATIO;
+}
+
+// Flush a file all the way to the disk.
+static void file_sync(FILE *file)
+{
+    fflush(file);
+#ifndef WIN32
+    fsync(fileno(file));
+#else
+    _commit(_fileno(file));
+#endif
+}
+
+static int file_truncate(FILE *file, long size)
+{
+    fflush(file);
+#ifndef WIN32
+    return ftruncate(fileno(file), size);
+#else
+    return _chsize(_fileno(file), size);
+#endif
 }
 
-void save_to_file(goxel_t *goxel, const char *path)
+// Atomically replace the file at path with the file at tmp_path.
+static int file_replace(const char *tmp_path, const char *path)
+{
+#ifndef WIN32
+    return rename(tmp_path, path);
+#else
+    return MoveFileEx(tmp_path, path, MOVEFILE_REPLACE_EXISTING) ? 0 : -1;
+#endif
+}
+
+/*
+ * Save an image into a file, and return the number of bytes written, or -1
+ * in case of error.
+ *
+ * If possible, only the blocks not already in the file are appended,
+ * otherwise the file is written to a temporary file that atomically
+ * replaces the previous one.  The state is updated accordingly.  A failed
+ * append is truncated back, and if we crash in the middle of one, the
+ * loader ignores the incomplete set of layers at the end of the file.
+ *
+ * This does not modify the image or any of its blocks, so it can run in a
+ * background thread on a copy of the image.
+ */
+long save_image(const image_t *img, const char *path,
+                save_state_t **state_ptr)
 {
     // XXX: remove all empty blocks before saving.
-    LOG_I("Save to %s", path);
+    save_state_t *state = *state_ptr;
+    saved_block_t *saved;
     block_hash_t *blocks_table = NULL, *data, *data_tmp;
     layer_t *layer;
     block_t *block;
     chunk_t c;
-    int nb_blocks, index, size;
+    int nb_blocks, nb_layers, size;
+    long start, written, initial_size = 0;
+    bool append, gz = str_endswith(path, ".gz");
     FILE *out;
     uint8_t *png;
     char *tmp_path = NULL;
     char *cmd;
 
-    if (str_endswith(path, ".gz")) {
-        asprintf(&tmp_path, "%s_XXXXXX", path);
-        out = fdopen(mkstemp(tmp_path), "wb");
-        LOG_I("Use tmp file %s", tmp_path);
-    } else {
-        out = fopen(path, "wb");
-    }
-
-    fwrite("GOX ", 4, 1, out);
-    write_int32(out, 1);
-
     // Add all the blocks data into the hash table.
-    index = 0;
-    DL_FOREACH(goxel->image->layers, layer) {
+    DL_FOREACH(img->layers, layer) {
         DL_FOREACH(layer->mesh->blocks, block) {
             HASH_FIND_PTR(blocks_table, &block->data, data);
             if (data) continue;
             data = calloc(1, sizeof(*data));
             data->v = block->data;
-            data->index = index++;
+            hash_128(data->v->voxels, sizeof(data->v->voxels), data->hash);
             HASH_ADD_PTR(blocks_table, v, data);
         }
     }
 
-    // Write all the blocks chunks.
+    append = can_append(blocks_table, state, path);
+    LOG_I("Save to %s%s", path, append ? " (incremental)" : "");
+
+    if (append) {
+        out = fopen(path, "r+b");
+        if (!out) goto error;
+        fseek(out, 0, SEEK_END);
+        initial_size = ftell(out);
+        nb_layers = 0;
+        DL_COUNT(img->layers, layer, nb_layers);
+        chunk_write_start(&c, out, "LSET");
+        chunk_write_int32(&c, out, nb_layers);
+        chunk_write_finish(&c, out);
+    } else {
+        save_state_delete(state);
+        state = *state_ptr = save_state_new(path);
+        if (gz) {
+            asprintf(&tmp_path, "%s_XXXXXX", path);
+            out = fdopen(mkstemp(tmp_path), "wb");
+        } else {
+            asprintf(&tmp_path, "%s.tmp", path);
+            out = fopen(tmp_path, "wb");
+        }
+        LOG_D("Use tmp file %s", tmp_path);
+        if (!out) goto error;
+        fwrite("GOX ", 4, 1, out);
+        write_int32(out, 3);
+    }
+
+    // Write all the blocks chunks that are not already in the file.
     HASH_ITER(hh, blocks_table, data, data_tmp) {
-        png = img_write_to_mem((uint8_t*)data->v->voxels, 64, 64, 4, &size);
-        chunk_write_all(out, "BL16", (char*)png, size);
-        free(png);
+        saved = save_state_find(state, data->hash);
+        if (!saved) {
+            start = ftell(out);
+            png = img_write_to_mem((uint8_t*)data->v->voxels,
+                                   64, 64, 4, &size);
+            chunk_write_all(out, "BL16", (char*)png, size);
+            free(png);
+            saved = save_state_add(state, data->hash, state->nb_blocks++,
+                                   ftell(out) - start);
+        }
+        data->index = saved->index;
     }
 
     // Write all the layers.
-    DL_FOREACH(goxel->image->layers, layer) {
+    DL_FOREACH(img->layers, layer) {
         chunk_write_start(&c, out, "LAYR");
         nb_blocks = 0;
         DL_COUNT(layer->mesh->blocks, block, nb_blocks);
@@ -236,6 +458,7 @@ void save_to_file(goxel_t *goxel, const char *path)
         }
         chunk_write_dict_value(&c, out, "name", layer->name,
                                strlen(layer->name));
+        chunk_write_dict_value(&c, out, "id", (char*)&layer->id, 4);
         chunk_write_finish(&c, out);
     }
 
@@ -244,31 +467,165 @@ void save_to_file(goxel_t *goxel, const char *path)
         free(data);
     }
 
+    state->size = ftell(out);
+    written = state->size - initial_size;
+    file_sync(out);
+    if (ferror(out)) {
+        // Remove what we appended, so that the file stays as it was.
+        if (append) {
+            clearerr(out);
+            if (file_truncate(out, initial_size) == 0) file_sync(out);
+        }
+        fclose(out);
+        goto error;
+    }
     fclose(out);
-    if (tmp_path) {
+
+    if (gz) {
         asprintf(&cmd, "gzip -c %s > %s", tmp_path, path);
         system(cmd);
         free(cmd);
         remove(tmp_path);
-        free(tmp_path);
+        // We can't append to a compressed file.
+        save_state_delete(state);
+        *state_ptr = NULL;
+    } else if (tmp_path && file_replace(tmp_path, path) != 0) {
+        goto error;
     }
+    free(tmp_path);
+    return written;
+
+error:
+    LOG_E("Cannot save to %s", path);
+    HASH_ITER(hh, blocks_table, data, data_tmp) {
+        HASH_DEL(blocks_table, data);
+        free(data);
+    }
+    if (tmp_path) remove(tmp_path);
+    free(tmp_path);
+    // We don't know the state of the file anymore.
+    save_state_delete(*state_ptr);
+    *state_ptr = NULL;
+    return -1;
 }
 
-static block_hash_t *hash_find_at(block_hash_t *hash, int index)
+/*
+ * Copy the inner voxels of a block saved with the layout of the files
+ * before version 3 into a mesh.
+ */
+static void add_legacy_block(mesh_t *mesh, const block_data_t *data,
+                             const vec3_t *pos)
 {
-    int i;
-    for (i = 0; i < index; i++) {
-        hash = hash->hh.next;
+    const int N = BLOCK_SIZE;
+    int x, y, z;
+    uvec4b_t v;
+    vec3_t p;
+    for (z = 1; z < N - 1; z++)
+    for (y = 1; y < N - 1; y++)
+    for (x = 1; x < N - 1; x++) {
+        v = data->voxels[x + y * N + z * N * N];
+        if (!v.a) continue;
+        p = vec3(pos->x + x - N / 2 + 0.5,
+                 pos->y + y - N / 2 + 0.5,
+                 pos->z + z - N / 2 + 0.5);
+        mesh_set_at(mesh, &p, v);
     }
-    return hash;
 }
 
-void load_from_file(goxel_t *goxel, const char *path)
+// Read an EDIT chunk and apply it to the image.
+static int load_edit(image_t *img, chunk_t *c, FILE *in)
 {
-    layer_t *layer, *layer_tmp;
+    history_t hist = {};
+    layer_t *layer, *tmp;
+    block_data_t *data;
+    uint8_t *png, *voxels;
+    int i, j, nb_layers, nb_blocks, size, x, y, z, w, h, bpp, ret = -1;
+    vec3_t pos;
+
+    hist.active_after = chunk_read_int32(c, in);
+    nb_layers = chunk_read_int32(c, in);
+    if (c->error || nb_layers <= 0) goto end;
+    for (i = 0; i < nb_layers; i++) {
+        layer = calloc(1, sizeof(*layer));
+        DL_APPEND(hist.after, layer);
+        layer->id = chunk_read_int32(c, in);
+        layer->visible = chunk_read_int32(c, in);
+        size = chunk_read_int32(c, in);
+        if (c->error || size < 0 || size >= (int)sizeof(layer->name))
+            goto end;
+        chunk_read(c, in, layer->name, size);
+        nb_blocks = chunk_read_int32(c, in);
+        if (c->error || nb_blocks < 0) goto end;
+        if (nb_blocks) layer->mesh = mesh_new();
+        for (j = 0; j < nb_blocks; j++) {
+            x = chunk_read_int32(c, in);
+            y = chunk_read_int32(c, in);
+            z = chunk_read_int32(c, in);
+            size = chunk_read_int32(c, in);
+            pos = vec3(x, y, z);
+            if (c->error || size < 0 || size > c->length - c->pos ||
+                    x % BLOCK_SIZE || y % BLOCK_SIZE || z % BLOCK_SIZE ||
+                    mesh_get_block_at(layer->mesh, &pos))
+                goto end;
+            data = NULL;
+            if (size) {
+                png = malloc(size);
+                chunk_read(c, in, (char*)png, size);
+                bpp = 4;
+                voxels = c->error ? NULL :
+                    img_read_from_mem((void*)png, size, &w, &h, &bpp);
+                free(png);
+                if (!voxels || w != 64 || h != 64 || bpp != 4) {
+                    free(voxels);
+                    goto end;
+                }
+                data = calloc(1, sizeof(*data));
+                memcpy(data->voxels, voxels, sizeof(data->voxels));
+                free(voxels);
+                data->id = __atomic_add_fetch(&core()->block_next_id, 1,
+                                              __ATOMIC_RELAXED);
+                __atomic_add_fetch(&core()->block_count, 1, __ATOMIC_RELAXED);
+            }
+            mesh_add_block(layer->mesh, data, &pos);
+        }
+    }
+    if (c->pos != c->length) goto end;
+    image_apply_history(img, &hist);
+    ret = 0;
+
+end:
+    DL_FOREACH_SAFE(hist.after, layer, tmp) {
+        DL_DELETE(hist.after, layer);
+        mesh_delete(layer->mesh);
+        free(layer);
+    }
+    return ret;
+}
+
+static void delete_layers(layer_t **layers)
+{
+    layer_t *layer, *tmp;
+    DL_FOREACH_SAFE(*layers, layer, tmp) {
+        DL_DELETE(*layers, layer);
+        mesh_delete(layer->mesh);
+        free(layer);
+    }
+}
+
+/*
+ * Load a file into a new image.
+ *
+ * This does not touch the current image, nor any GL state, so that it can
+ * be called from a background thread.  Return NULL on error.  If progress
+ * is set, it is updated (atomically) with the loading progress in percent.
+ */
+image_t *load_image(const char *path, bool check_crc, int *progress)
+{
+    image_t *img;
+    layer_t *layer;
     block_hash_t *blocks_table = NULL, *data, *data_tmp;
     FILE *in;
-    char magic[4];
+    char magic[4] = {};
     uint8_t *voxel_data;
     int nb_blocks;
     int w, h, bpp;
@@ -281,6 +638,19 @@ void load_from_file(goxel_t *goxel, const char *path)
     char dict_value[256];
     char *tmp_path = NULL;
     char *cmd;
+    int block_index = 0;
+    block_data_t **chunks = NULL; // Block data of each BL16 chunk.
+    uint64_t hash[2];
+    save_state_t *state = NULL;
+    int version;
+    int chunk_index = 0;
+    long chunk_pos, size;
+    int nb_edits = 0;
+    bool corrupted = false, ok = false, interrupted = false;
+    layer_t *prev_layers = NULL, *prev_active = NULL;
+    int nb_layers;
+    int set_missing = 0; // Number of layers of the last set not read yet.
+    long set_pos = 0;
 
     LOG_I("Load from file %s", path);
     if (str_endswith(path, ".gz")) {
@@ -293,75 +663,766 @@ void load_from_file(goxel_t *goxel, const char *path)
     } else {
         in = fopen(path, "rb");
     }
+    if (!in) {
+        LOG_E("Cannot open %s", path);
+        if (tmp_path) remove(tmp_path);
+        free(tmp_path);
+        return NULL;
+    }
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    fseek(in, 0, SEEK_SET);
 
+    img = calloc(1, sizeof(*img));
     fread(magic, 4, 1, in);
-    assert(strncmp(magic, "GOX ", 4) == 0);
-    read_int32(in);
-
-    // Remove all layers.
-    // XXX: we should load the image fully before deleting the current one.
-    DL_FOREACH_SAFE(goxel->image->layers, layer, layer_tmp) {
-        mesh_delete(layer->mesh);
-        free(layer);
+    if (strncmp(magic, "GOX ", 4) != 0) {
+        LOG_E("%s: not a gox file", path);
+        goto end;
     }
-    goxel->image->layers = NULL;
+    version = read_int32(in);
+    chunk_pos = ftell(in);
 
     while (chunk_read_start(&c, in)) {
+        if (c.error || c.length > size) goto bad_chunk;
         if (strncmp(c.type, "BL16", 4) == 0) {
             png = calloc(1, c.length);
             chunk_read(&c, in, (char*)png, c.length);
+            if (c.error) {
+                free(png);
+                goto bad_chunk;
+            }
             bpp = 4;
             voxel_data = img_read_from_mem((void*)png, c.length, &w, &h, &bpp);
-            assert(w == 64 && h == 64 && bpp == 4);
-            data = calloc(1, sizeof(*data));
-            data->v = calloc(1, sizeof(*data->v));
-            memcpy(data->v->voxels, voxel_data, sizeof(data->v->voxels));
-            data->v->id = ++goxel->block_next_id;
-            HASH_ADD_PTR(blocks_table, v, data);
-            free(voxel_data);
             free(png);
+            if (!voxel_data || w != 64 || h != 64 || bpp != 4) {
+                free(voxel_data);
+                goto bad_chunk;
+            }
+            // Share the data of identical blocks.
+            hash_128(voxel_data, sizeof(data->v->voxels), hash);
+            HASH_FIND(hh, blocks_table, hash, sizeof(hash), data);
+            if (!data || memcmp(data->v->voxels, voxel_data,
+                                sizeof(data->v->voxels)) != 0) {
+                data = calloc(1, sizeof(*data));
+                data->v = calloc(1, sizeof(*data->v));
+                memcpy(data->v->voxels, voxel_data, sizeof(data->v->voxels));
+                memcpy(data->hash, hash, sizeof(hash));
+                data->v->id = __atomic_add_fetch(&core()->block_next_id, 1,
+                                                 __ATOMIC_RELAXED);
+                data->v->ref = 1; // Released once the file is fully loaded.
+                data->index = block_index;
+                data->size = c.length + 12;
+                HASH_ADD(hh, blocks_table, hash, sizeof(data->hash), data);
+                __atomic_add_fetch(&core()->block_count, 1, __ATOMIC_RELAXED);
+            }
+            chunks = realloc(chunks, (block_index + 1) * sizeof(*chunks));
+            chunks[block_index++] = data->v;
+            free(voxel_data);
+
+        } else if (strncmp(c.type, "LSET", 4) == 0) {
+            nb_layers = chunk_read_int32(&c, in);
+            if (c.error || c.length != 4 || nb_layers <= 0) goto bad_chunk;
+            // Keep the previous set until the new one is complete, in case
+            // the save got interrupted.
+            if (set_missing) {
+                delete_layers(&img->layers);
+            } else {
+                delete_layers(&prev_layers);
+                prev_layers = img->layers;
+                prev_active = img->active_layer;
+                img->layers = NULL;
+            }
+            img->active_layer = NULL;
+            set_pos = chunk_pos;
+            set_missing = nb_layers;
 
         } else if (strncmp(c.type, "LAYR", 4) == 0) {
-            layer = calloc(1, sizeof(*layer));
-            layer->mesh = mesh_new();
-            layer->visible = true;
-            DL_APPEND(goxel->image->layers, layer);
-            goxel->image->active_layer = layer;
+            layer = image_new_layer(img, "");
+            DL_APPEND(img->layers, layer);
+            img->active_layer = layer;
 
-            nb_blocks = chunk_read_int32(&c, in);   assert(nb_blocks >= 0);
+            nb_blocks = chunk_read_int32(&c, in);
+            if (nb_blocks < 0) goto bad_chunk;
             for (i = 0; i < nb_blocks; i++) {
-                index = chunk_read_int32(&c, in);   assert(index >= 0);
+                index = chunk_read_int32(&c, in);
                 x = chunk_read_int32(&c, in);
                 y = chunk_read_int32(&c, in);
                 z = chunk_read_int32(&c, in);
                 chunk_read_int32(&c, in);
-                data = hash_find_at(blocks_table, index);
-                assert(data);
+                if (c.error || index < 0 || index >= block_index)
+                    goto bad_chunk;
                 pos = vec3(x, y, z);
-                mesh_add_block(layer->mesh, data->v, &pos);
+                if (version < 3) {
+                    add_legacy_block(layer->mesh, chunks[index], &pos);
+                    continue;
+                }
+                if (x % BLOCK_SIZE || y % BLOCK_SIZE || z % BLOCK_SIZE ||
+                        mesh_get_block_at(layer->mesh, &pos))
+                    goto bad_chunk;
+                mesh_add_block(layer->mesh, chunks[index], &pos);
             }
             while ((dict_value_size = chunk_read_dict_value(&c, in,
-                                                dict_key, dict_value))) {
-                if (strcmp(dict_key, "name") == 0)
-                    sprintf(layer->name, "%s", dict_value);
+                                                dict_key, dict_value)) > 0) {
+                if (strcmp(dict_key, "name") == 0) {
+                    if (dict_value_size >= sizeof(layer->name))
+                        goto bad_chunk;
+                    memcpy(layer->name, dict_value, dict_value_size + 1);
+                }
+                if (strcmp(dict_key, "id") == 0 && dict_value_size == 4) {
+                    memcpy(&layer->id, dict_value, 4);
+                    img->layers_next_id = max(img->layers_next_id,
+                                              layer->id);
+                }
             }
-        } else assert(false);
-        chunk_read_finish(&c, in);
+            if (dict_value_size < 0) goto bad_chunk;
+        } else if (strncmp(c.type, "EDIT", 4) == 0) {
+            if (!img->layers || load_edit(img, &c, in) != 0) goto bad_chunk;
+            nb_edits++;
+        } else {
+            LOG_W("%s: skip unknown chunk %s", path, c.type);
+            png = calloc(1, c.length);
+            chunk_read(&c, in, (char*)png, c.length);
+            free(png);
+        }
+        if (c.error || c.pos != c.length) goto bad_chunk;
+        // Version 1 files have no CRC.  Only report the first error.
+        if (!chunk_read_finish(&c, in) && version >= 2 &&
+                check_crc && !corrupted) {
+            LOG_E("%s: bad CRC in chunk %d (%s) at offset %ld",
+                  path, chunk_index, c.type, chunk_pos);
+            corrupted = true;
+        }
+        if (feof(in)) goto bad_chunk;
+        // The previous set is only dropped once the new one is complete.
+        if (strncmp(c.type, "LAYR", 4) == 0 && set_missing &&
+                --set_missing == 0)
+            delete_layers(&prev_layers);
+        chunk_index++;
+        chunk_pos = ftell(in);
+        if (progress)
+            __atomic_store_n(progress, chunk_pos * 100 / size,
+                             __ATOMIC_RELAXED);
+    }
+loaded:
+    if (set_missing) {
+        LOG_W("%s: ignore the interrupted save at offset %ld",
+              path, set_pos);
+        delete_layers(&img->layers);
+        img->layers = prev_layers;
+        img->active_layer = prev_active;
+        prev_layers = NULL;
+        interrupted = true;
+    }
+    if (!img->layers) {
+        LOG_E("%s: no layers", path);
+        goto end;
+    }
+
+    // Keep track of the blocks in the file for the next incremental save.
+    // We never append to files of previous versions, since version 1 files
+    // have no CRC, and version 2 files use the old blocks layout, nor to
+    // journals, nor after an interrupted save, nor when the file ends with
+    // an incomplete chunk.
+    if (!tmp_path && version >= 3 && !nb_edits && !interrupted &&
+            !corrupted && chunk_pos == size) {
+        state = save_state_new(path);
+        state->size = ftell(in);
+        state->nb_blocks = block_index;
     }
+    img->path = strdup(path);
+    ok = true;
+    goto end;
 
-    // Free the block hash table.  We do not delete the block data because
-    // they have been used by the meshes.
+bad_chunk:
+    // The end of an interrupted incremental save can contain anything.
+    if (set_missing) goto loaded;
+    if (strncmp(c.type, "LSET", 4) == 0 && img->layers) {
+        LOG_W("%s: ignore the interrupted save at offset %ld",
+              path, chunk_pos);
+        interrupted = true;
+        goto loaded;
+    }
+    // A journal can end with a change that was being written when the
+    // program stopped.
+    if (nb_edits && feof(in)) {
+        LOG_W("%s: ignore truncated chunk at offset %ld", path, chunk_pos);
+        goto loaded;
+    }
+    LOG_E("%s: invalid chunk %d (%s) at offset %ld",
+          path, chunk_index, c.type, chunk_pos);
+end:
+    // Free the block hash table.  We do not delete the block data that have
+    // been used by the meshes.  Chunks left by previous incremental saves
+    // might not be used anymore.
     HASH_ITER(hh, blocks_table, data, data_tmp) {
         HASH_DEL(blocks_table, data);
+        if (--data->v->ref == 0) {
+            free(data->v);
+            __atomic_sub_fetch(&core()->block_count, 1, __ATOMIC_RELAXED);
+        } else if (state) {
+            save_state_add(state, data->hash, data->index, data->size);
+        }
         free(data);
     }
-
-    goxel->image->path = strdup(path);
-    goxel_update_meshes(goxel, true);
-    image_history_push(goxel->image);
+    free(chunks);
+    delete_layers(&prev_layers);
+    img->save_state = state;
+    if (!ok) {
+        image_delete(img);
+        img = NULL;
+    }
     fclose(in);
     if (tmp_path) {
         remove(tmp_path);
         free(tmp_path);
     }
+    return img;
+}
+
+/*
+ * Undo history scratch file.
+ *
+ * The history entries far from the current one can be moved to a temporary
+ * file (see image.c), using the same chunks as the gox files:
+ *
+ *  BRAW: the raw RGBA voxels of a 16^3 block.  Like for the saves, the
+ *        blocks are deduplicated by the hash of their content, so that
+ *        identical blocks from different entries are only written once.
+ *
+ *  HIST: the blocks of an entry, for each layer before, then after the
+ *        change:
+ *      4 bytes: number of blocks, -1 for no mesh.
+ *      for each block:
+ *          4 bytes: block index (-1 for an empty block)
+ *          4 bytes: x
+ *          4 bytes: y
+ *          4 bytes: z
+ *
+ * XXX: the file is never compacted, the chunks of the deleted entries are
+ * only released with the image.
+ */
+
+struct history_scratch {
+    FILE            *file;
+    bool            error;      // Set after a write error.
+    int             nb_blocks;
+    long            *blocks_pos;
+    saved_block_t   *blocks;
+};
+
+typedef struct {
+    UT_hash_handle  hh;
+    int             index;
+    block_data_t    *v;
+} loaded_block_t;
+
+static history_scratch_t *history_scratch_new(void)
+{
+    history_scratch_t *scratch;
+    FILE *file = tmpfile();
+    if (!file) {
+        LOG_E("Cannot create the history scratch file");
+        return NULL;
+    }
+    scratch = calloc(1, sizeof(*scratch));
+    scratch->file = file;
+    fwrite("GOXH", 4, 1, file); // So that no chunk is at position 0.
+    return scratch;
+}
+
+void history_scratch_delete(history_scratch_t *scratch)
+{
+    saved_block_t *block, *tmp;
+    if (!scratch) return;
+    HASH_ITER(hh, scratch->blocks, block, tmp) {
+        HASH_DEL(scratch->blocks, block);
+        free(block);
+    }
+    free(scratch->blocks_pos);
+    fclose(scratch->file);
+    free(scratch);
+}
+
+// Write a block data in the scratch file if it is not there yet, and
+// return its index.
+static int scratch_add_block(history_scratch_t *scratch,
+                             const block_data_t *data)
+{
+    saved_block_t *saved;
+    uint64_t hash[2];
+
+    hash_128(data->voxels, sizeof(data->voxels), hash);
+    HASH_FIND(hh, scratch->blocks, hash, sizeof(hash), saved);
+    if (saved) return saved->index;
+    scratch->blocks_pos = realloc(scratch->blocks_pos,
+            (scratch->nb_blocks + 1) * sizeof(*scratch->blocks_pos));
+    fseek(scratch->file, 0, SEEK_END);
+    scratch->blocks_pos[scratch->nb_blocks] = ftell(scratch->file);
+    chunk_write_all(scratch->file, "BRAW", (const char*)data->voxels,
+                    sizeof(data->voxels));
+    saved = calloc(1, sizeof(*saved));
+    memcpy(saved->hash, hash, sizeof(hash));
+    saved->index = scratch->nb_blocks++;
+    HASH_ADD(hh, scratch->blocks, hash, sizeof(saved->hash), saved);
+    return saved->index;
+}
+
+static block_data_t *scratch_read_block(history_scratch_t *scratch,
+                                        int index)
+{
+    block_data_t *data;
+    chunk_t c;
+    FILE *in = scratch->file;
+
+    fseek(in, scratch->blocks_pos[index], SEEK_SET);
+    if (!chunk_read_start(&c, in) || strncmp(c.type, "BRAW", 4) != 0 ||
+            c.length != sizeof(data->voxels))
+        return NULL;
+    data = calloc(1, sizeof(*data));
+    chunk_read(&c, in, (char*)data->voxels, sizeof(data->voxels));
+    if (c.error || !chunk_read_finish(&c, in)) {
+        free(data);
+        return NULL;
+    }
+    data->id = __atomic_add_fetch(&core()->block_next_id, 1,
+                                  __ATOMIC_RELAXED);
+    data->ref = 1; // Released once the entry is fully loaded.
+    __atomic_add_fetch(&core()->block_count, 1, __ATOMIC_RELAXED);
+    return data;
+}
+
+int history_spill(history_t *hist, history_scratch_t **scratch_ptr)
+{
+    history_scratch_t *scratch;
+    layer_t *lists[2] = {hist->before, hist->after}, *layer;
+    block_t *block;
+    chunk_t c;
+    int i, k, nb = 0, *indexes;
+    long pos;
+    FILE *out;
+
+    if (hist->spilled) return 0;
+    // Entries that have been loaded back are still in the file.
+    if (hist->scratch_pos) goto end;
+    if (!*scratch_ptr) *scratch_ptr = history_scratch_new();
+    scratch = *scratch_ptr;
+    if (!scratch || scratch->error) return -1;
+    out = scratch->file;
+
+    // Write all the blocks data first, since the chunks can't be nested.
+    for (k = 0; k < 2; k++) {
+        DL_FOREACH(lists[k], layer) {
+            if (!layer->mesh) continue;
+            DL_FOREACH(layer->mesh->blocks, block) nb++;
+        }
+    }
+    indexes = calloc(nb, sizeof(*indexes));
+    i = 0;
+    for (k = 0; k < 2; k++) {
+        DL_FOREACH(lists[k], layer) {
+            if (!layer->mesh) continue;
+            DL_FOREACH(layer->mesh->blocks, block) {
+                indexes[i++] = block->data->id ?
+                    scratch_add_block(scratch, block->data) : -1;
+            }
+        }
+    }
+
+    fseek(out, 0, SEEK_END);
+    pos = ftell(out);
+    chunk_write_start(&c, out, "HIST");
+    i = 0;
+    for (k = 0; k < 2; k++) {
+        DL_FOREACH(lists[k], layer) {
+            if (!layer->mesh) {
+                chunk_write_int32(&c, out, -1);
+                continue;
+            }
+            nb = 0;
+            DL_COUNT(layer->mesh->blocks, block, nb);
+            chunk_write_int32(&c, out, nb);
+            DL_FOREACH(layer->mesh->blocks, block) {
+                chunk_write_int32(&c, out, indexes[i++]);
+                chunk_write_int32(&c, out, block->pos.x);
+                chunk_write_int32(&c, out, block->pos.y);
+                chunk_write_int32(&c, out, block->pos.z);
+            }
+        }
+    }
+    chunk_write_finish(&c, out);
+    free(indexes);
+    fflush(out);
+    if (ferror(out)) {
+        LOG_E("Cannot write the history scratch file");
+        scratch->error = true;
+        return -1;
+    }
+    hist->scratch_pos = pos;
+
+end:
+    for (k = 0; k < 2; k++) {
+        DL_FOREACH(lists[k], layer) {
+            mesh_delete(layer->mesh);
+            layer->mesh = NULL;
+        }
+    }
+    hist->spilled = true;
+    return 0;
+}
+
+int history_unspill(history_t *hist, history_scratch_t *scratch)
+{
+    layer_t *lists[2] = {hist->before, hist->after}, *layer;
+    loaded_block_t *loaded = NULL, *item, *tmp;
+    block_data_t *data;
+    chunk_t c;
+    int32_t *v = NULL;
+    int i, k, n, nb, index, ret = -1;
+    vec3_t pos;
+    FILE *in = scratch->file;
+
+    if (!hist->spilled) return 0;
+    fseek(in, hist->scratch_pos, SEEK_SET);
+    if (!chunk_read_start(&c, in) || strncmp(c.type, "HIST", 4) != 0 ||
+            c.length % 4)
+        goto end;
+    v = malloc(c.length);
+    chunk_read(&c, in, (char*)v, c.length);
+    if (c.error || !chunk_read_finish(&c, in)) goto end;
+
+    n = 0;
+    for (k = 0; k < 2; k++) {
+        DL_FOREACH(lists[k], layer) {
+            if (n >= c.length / 4) goto end;
+            nb = v[n++];
+            if (nb < 0) continue;
+            if (nb > (c.length / 4 - n) / 4) goto end;
+            layer->mesh = mesh_new();
+            for (i = 0; i < nb; i++, n += 4) {
+                index = v[n];
+                pos = vec3(v[n + 1], v[n + 2], v[n + 3]);
+                if (index < -1 || index >= scratch->nb_blocks ||
+                        mesh_get_block_at(layer->mesh, &pos))
+                    goto end;
+                data = NULL;
+                if (index >= 0) {
+                    HASH_FIND_INT(loaded, &index, item);
+                    if (!item) {
+                        item = calloc(1, sizeof(*item));
+                        item->index = index;
+                        item->v = scratch_read_block(scratch, index);
+                        HASH_ADD_INT(loaded, index, item);
+                    }
+                    if (!item->v) goto end;
+                    data = item->v;
+                }
+                mesh_add_block(layer->mesh, data, &pos);
+            }
+        }
+    }
+    hist->spilled = false;
+    ret = 0;
+
+end:
+    if (ret) {
+        LOG_E("Cannot read the history scratch file");
+        for (k = 0; k < 2; k++) {
+            DL_FOREACH(lists[k], layer) {
+                mesh_delete(layer->mesh);
+                layer->mesh = NULL;
+            }
+        }
+    }
+    HASH_ITER(hh, loaded, item, tmp) {
+        HASH_DEL(loaded, item);
+        if (item->v && --item->v->ref == 0) {
+            free(item->v);
+            __atomic_sub_fetch(&core()->block_count, 1, __ATOMIC_RELAXED);
+        }
+        free(item);
+    }
+    free(v);
+    return ret;
+}
+
+/*
+ * Journal.
+ *
+ * A gox file where each change of the image is appended as an EDIT chunk,
+ * see save_gui.c.  The chunks are written in one go and flushed, so that
+ * the file stays readable if the program crashes, but they are not synced
+ * to the disk, so they might not survive a crash of the system.
+ *
+ * journal_add only queues a copy of the layers, that shares the blocks
+ * data with the history, and a thread encodes and writes the chunks, so
+ * that the changes cost nothing to the UI.  The queued entries are only
+ * freed from the calling thread, since the meshes refs are not atomic.
+ */
+
+typedef struct journal_entry journal_entry_t;
+struct journal_entry {
+    journal_entry_t *next, *prev;
+    int             active;
+    layer_t         *layers;
+};
+
+struct journal {
+    char            *path;
+    FILE            *file;
+    bool            error;      // Set after a write error.
+    pthread_t       thread;
+    pthread_mutex_t mutex;      // Protects everything below, and the file.
+    pthread_cond_t  cond;
+    journal_entry_t *queue;     // Changes not written yet.
+    journal_entry_t *done;      // Written, not freed yet.
+    bool            closing;
+};
+
+typedef struct {
+    char    *data;
+    int     size;
+} buffer_t;
+
+static void buffer_write(buffer_t *buf, const void *data, int size)
+{
+    buf->data = realloc(buf->data, buf->size + size);
+    memcpy(buf->data + buf->size, data, size);
+    buf->size += size;
+}
+
+static void buffer_write_int32(buffer_t *buf, int32_t v)
+{
+    buffer_write(buf, &v, 4);
+}
+
+static void journal_entry_delete(journal_entry_t *entry)
+{
+    layer_t *layer, *tmp;
+    DL_FOREACH_SAFE(entry->layers, layer, tmp) {
+        DL_DELETE(entry->layers, layer);
+        mesh_delete(layer->mesh);
+        free(layer);
+    }
+    free(entry);
+}
+
+// Free the entries already written.
+static void journal_release_done(journal_t *journal)
+{
+    journal_entry_t *done, *entry, *tmp;
+    pthread_mutex_lock(&journal->mutex);
+    done = journal->done;
+    journal->done = NULL;
+    pthread_mutex_unlock(&journal->mutex);
+    DL_FOREACH_SAFE(done, entry, tmp) {
+        DL_DELETE(done, entry);
+        journal_entry_delete(entry);
+    }
+}
+
+// Encode the data of an EDIT chunk.
+static void journal_entry_encode(const journal_entry_t *entry, buffer_t *buf)
+{
+    const layer_t *layer;
+    const block_t *block;
+    uint8_t *png;
+    int nb, size;
+
+    buffer_write_int32(buf, entry->active);
+    nb = 0;
+    DL_COUNT(entry->layers, layer, nb);
+    buffer_write_int32(buf, nb);
+    DL_FOREACH(entry->layers, layer) {
+        buffer_write_int32(buf, layer->id);
+        buffer_write_int32(buf, layer->visible);
+        buffer_write_int32(buf, strlen(layer->name));
+        buffer_write(buf, layer->name, strlen(layer->name));
+        nb = 0;
+        if (layer->mesh) DL_COUNT(layer->mesh->blocks, block, nb);
+        buffer_write_int32(buf, nb);
+        if (!nb) continue;
+        DL_FOREACH(layer->mesh->blocks, block) {
+            buffer_write_int32(buf, block->pos.x);
+            buffer_write_int32(buf, block->pos.y);
+            buffer_write_int32(buf, block->pos.z);
+            if (!block->data->id) { // Global empty data.
+                buffer_write_int32(buf, 0);
+                continue;
+            }
+            png = img_write_to_mem((uint8_t*)block->data->voxels,
+                                   64, 64, 4, &size);
+            buffer_write_int32(buf, size);
+            buffer_write(buf, png, size);
+            free(png);
+        }
+    }
+}
+
+static void *journal_thread_func(void *arg)
+{
+    journal_t *journal = arg;
+    journal_entry_t *entry;
+    buffer_t buf;
+
+    pthread_mutex_lock(&journal->mutex);
+    while (true) {
+        while (!journal->queue && !journal->closing)
+            pthread_cond_wait(&journal->cond, &journal->mutex);
+        // We write all the queued changes before closing.
+        entry = journal->queue;
+        if (!entry) break;
+        memset(&buf, 0, sizeof(buf));
+        if (!journal->error) {
+            pthread_mutex_unlock(&journal->mutex);
+            journal_entry_encode(entry, &buf);
+            pthread_mutex_lock(&journal->mutex);
+        }
+        DL_DELETE(journal->queue, entry);
+        DL_APPEND(journal->done, entry);
+        if (journal->error) continue;
+        chunk_write_all(journal->file, "EDIT", buf.data, buf.size);
+        free(buf.data);
+        fflush(journal->file);
+        if (ferror(journal->file)) {
+            LOG_E("Cannot write journal %s", journal->path);
+            journal->error = true;
+        }
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return NULL;
+}
+
+journal_t *journal_new(const char *path)
+{
+    journal_t *journal;
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        LOG_E("Cannot create journal %s", path);
+        return NULL;
+    }
+    fwrite("GOX ", 4, 1, file);
+    write_int32(file, 3);
+    fflush(file);
+    journal = calloc(1, sizeof(*journal));
+    journal->path = strdup(path);
+    journal->file = file;
+    pthread_mutex_init(&journal->mutex, NULL);
+    pthread_cond_init(&journal->cond, NULL);
+    if (pthread_create(&journal->thread, NULL, journal_thread_func,
+                       journal) != 0) {
+        LOG_E("Cannot start journal thread");
+        pthread_mutex_destroy(&journal->mutex);
+        pthread_cond_destroy(&journal->cond);
+        fclose(file);
+        free(journal->path);
+        free(journal);
+        return NULL;
+    }
+    return journal;
+}
+
+void journal_delete(journal_t *journal)
+{
+    if (!journal) return;
+    pthread_mutex_lock(&journal->mutex);
+    journal->closing = true;
+    pthread_cond_signal(&journal->cond);
+    pthread_mutex_unlock(&journal->mutex);
+    pthread_join(journal->thread, NULL);
+    journal_release_done(journal);
+    pthread_mutex_destroy(&journal->mutex);
+    pthread_cond_destroy(&journal->cond);
+    if (journal->file) fclose(journal->file);
+    free(journal->path);
+    free(journal);
+}
+
+long journal_get_size(journal_t *journal)
+{
+    long size;
+    pthread_mutex_lock(&journal->mutex);
+    size = journal->file ? ftell(journal->file) : 0;
+    pthread_mutex_unlock(&journal->mutex);
+    return size;
+}
+
+int journal_get_pending(journal_t *journal)
+{
+    journal_entry_t *entry;
+    int nb = 0;
+    pthread_mutex_lock(&journal->mutex);
+    DL_COUNT(journal->queue, entry, nb);
+    pthread_mutex_unlock(&journal->mutex);
+    return nb;
+}
+
+int journal_add(journal_t *journal, const history_t *hist, bool undo)
+{
+    const layer_t *layer, *layers = undo ? hist->before : hist->after;
+    journal_entry_t *entry;
+    layer_t *copy;
+    bool error;
+
+    journal_release_done(journal);
+    pthread_mutex_lock(&journal->mutex);
+    error = journal->error;
+    pthread_mutex_unlock(&journal->mutex);
+    if (error) return -1;
+
+    entry = calloc(1, sizeof(*entry));
+    entry->active = undo ? hist->active_before : hist->active_after;
+    DL_FOREACH(layers, layer) {
+        copy = calloc(1, sizeof(*copy));
+        *copy = *layer;
+        copy->next = copy->prev = NULL;
+        copy->mesh = layer->mesh ? mesh_copy(layer->mesh) : NULL;
+        DL_APPEND(entry->layers, copy);
+    }
+    pthread_mutex_lock(&journal->mutex);
+    DL_APPEND(journal->queue, entry);
+    pthread_cond_signal(&journal->cond);
+    pthread_mutex_unlock(&journal->mutex);
+    return 0;
+}
+
+int journal_checkpoint(journal_t *journal, const char *path, long pos)
+{
+    FILE *in = NULL, *out = NULL;
+    char buf[4096];
+    size_t n;
+    int ret = -1;
+
+    pthread_mutex_lock(&journal->mutex);
+    if (journal->error) goto end;
+    in = fopen(journal->path, "rb");
+    out = fopen(path, "ab");
+    if (!in || !out) goto end;
+    fseek(in, pos, SEEK_SET);
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0)
+        fwrite(buf, 1, n, out);
+    file_sync(out);
+    if (ferror(in) || ferror(out)) goto end;
+    // Windows can't replace a file that is still open.
+    fclose(in);
+    fclose(out);
+    in = out = NULL;
+    fclose(journal->file);
+    ret = file_replace(path, journal->path);
+    journal->file = fopen(journal->path, "ab");
+    if (journal->file) fseek(journal->file, 0, SEEK_END);
+    if (!journal->file) {
+        LOG_E("Cannot open journal %s", journal->path);
+        journal->error = true;
+        ret = -1;
+    }
+
+end:
+    if (in) fclose(in);
+    if (out) fclose(out);
+    if (ret) {
+        LOG_E("Cannot write journal checkpoint %s", path);
+        remove(path);
+    }
+    pthread_mutex_unlock(&journal->mutex);
+    return ret;
 }
@@ -0,0 +1,404 @@
+/* Goxel 3D voxels editor
+ *
+ * copyright (c) 2015 Guillaume Chereau <guillaume@noctua-software.com>
+ *
+ * Goxel is free software: you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, either version 3 of the License, or (at your option) any later
+ * version.
+
+ * Goxel is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE.  See the GNU General Public License for more
+ * details.
+
+ * You should have received a copy of the GNU General Public License along with
+ * goxel.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The editor side of the files: loading into the current image, background
+ * loading, autosave and journal.  The file format itself is in save.c.
+ */
+
+#include "goxel.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+void save_to_file(goxel_t *goxel, const char *path)
+{
+    save_image(goxel->image, path, &goxel->image->save_state);
+}
+
+/*
+ * Autosave.
+ *
+ * We take a copy of the image, which is cheap since the meshes and blocks
+ * data use copy on write, and save it from a background thread.  The
+ * background thread only reads the copy: all the reference counting (copy
+ * and deletion of the snapshot) is done from the main thread.
+ */
+static struct {
+    pthread_t       thread;
+    bool            running;
+    int             done;       // Set by the thread when finished.
+    image_t         *snapshot;
+    uint64_t        saved;      // Serial of the history entry last saved.
+    double          last_time;
+    save_state_t    *state;     // Owned by the thread while running.
+    long            bytes;
+    double          duration;
+} g_autosave = {};
+
+static void *autosave_thread_func(void *arg)
+{
+    char *path;
+    double start = get_unix_time();
+    asprintf(&path, "%s/autosave.gox", sys_get_data_dir());
+    create_dirs(path);
+    g_autosave.bytes = save_image(g_autosave.snapshot, path,
+                                  &g_autosave.state);
+    g_autosave.duration = get_unix_time() - start;
+    free(path);
+    __atomic_store_n(&g_autosave.done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void autosave_iter(goxel_t *goxel)
+{
+    double time = get_unix_time();
+    // Compare the serials rather than the entries, since a new entry can
+    // reuse the address of a deleted one.
+    uint64_t current = goxel->image->history_current ?
+                       goxel->image->history_current->serial : 0;
+
+    if (g_autosave.running) {
+        if (!__atomic_load_n(&g_autosave.done, __ATOMIC_ACQUIRE)) return;
+        pthread_join(g_autosave.thread, NULL);
+        g_autosave.running = false;
+        image_delete(g_autosave.snapshot);
+        g_autosave.snapshot = NULL;
+        LOG_D("Autosave: %ld bytes in %.1fms", g_autosave.bytes,
+              g_autosave.duration * 1000);
+        PROFILER_COUNTER_SET("autosave time (us)",
+                             g_autosave.duration * 1000 * 1000);
+        PROFILER_COUNTER_SET("autosave bytes", g_autosave.bytes);
+    }
+
+    if (!g_autosave.last_time) {
+        g_autosave.last_time = time;
+        g_autosave.saved = current;
+    }
+    if (!goxel->autosave_interval) return;
+    if (goxel->painting) return;
+    if (current == g_autosave.saved) return;
+    if (time - g_autosave.last_time < goxel->autosave_interval) return;
+
+    g_autosave.saved = current;
+    g_autosave.last_time = time;
+    g_autosave.snapshot = image_copy(goxel->image);
+    g_autosave.done = 0;
+    g_autosave.running = true;
+    if (pthread_create(&g_autosave.thread, NULL, autosave_thread_func,
+                       NULL) != 0) {
+        LOG_E("Cannot start autosave thread");
+        g_autosave.running = false;
+        image_delete(g_autosave.snapshot);
+        g_autosave.snapshot = NULL;
+    }
+}
+
+// Replace the current image with a loaded one.
+static void set_image(goxel_t *goxel, image_t *img)
+{
+    tool_cancel(goxel, goxel->tool, goxel->tool_state);
+    img->export_width = goxel->image->export_width;
+    img->export_height = goxel->image->export_height;
+    image_delete(goxel->image);
+    goxel->image = img;
+    image_history_push(img);
+    goxel_update_meshes(goxel, true);
+}
+
+void load_from_file(goxel_t *goxel, const char *path)
+{
+    image_t *img = load_image(path, goxel->core.check_crc, NULL);
+    if (img) set_image(goxel, img);
+}
+
+/*
+ * Background loading.
+ *
+ * The thread builds a new image, that we swap with the current one from
+ * the main thread once it is done.  All the block data of the new image are
+ * only referenced by it until then, so we don't need any locking, except
+ * for the global block id and count that are updated atomically.
+ */
+static struct {
+    pthread_t       thread;
+    bool            running;
+    int             done;       // Set by the thread when finished.
+    char            *path;
+    bool            check_crc;
+    int             progress;   // In percent.
+    image_t         *img;       // Loaded image, NULL on error.
+} g_load = {};
+
+static void *load_thread_func(void *arg)
+{
+    g_load.img = load_image(g_load.path, g_load.check_crc, &g_load.progress);
+    __atomic_store_n(&g_load.done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void load_from_file_async(goxel_t *goxel, const char *path)
+{
+    if (g_load.running) {
+        LOG_W("Already loading %s", g_load.path);
+        return;
+    }
+    free(g_load.path);
+    g_load.path = strdup(path);
+    g_load.check_crc = goxel->core.check_crc;
+    g_load.progress = 0;
+    g_load.img = NULL;
+    g_load.done = 0;
+    g_load.running = true;
+    if (pthread_create(&g_load.thread, NULL, load_thread_func, NULL) != 0) {
+        LOG_E("Cannot start loading thread");
+        g_load.running = false;
+        load_from_file(goxel, path);
+    }
+}
+
+void load_iter(goxel_t *goxel)
+{
+    if (!g_load.running) return;
+    if (!__atomic_load_n(&g_load.done, __ATOMIC_ACQUIRE)) {
+        goxel_set_help_text(goxel, "Loading %s: %d%%", g_load.path,
+                __atomic_load_n(&g_load.progress, __ATOMIC_RELAXED));
+        return;
+    }
+    if (goxel->painting) return;
+    pthread_join(g_load.thread, NULL);
+    g_load.running = false;
+    if (g_load.img) set_image(goxel, g_load.img);
+    g_load.img = NULL;
+}
+
+/*
+ * Journal.
+ *
+ * All the changes of the image (push, undo and redo of the history entries)
+ * are appended to <data dir>/journal-<pid>.gox, after a full save of the
+ * image (the checkpoint), so that loading the file gives back the image as
+ * of the last change.  The file is removed when we exit properly.
+ *
+ * Each process holds a lock on <data dir>/journal-<pid>.lock as long as it
+ * runs, so at startup a journal whose lock is free was left by a session
+ * that crashed, while the ones still locked belong to other running
+ * instances.
+ *
+ * The checkpoints are saved like the autosave, from a background thread,
+ * using the image as of the last push.  Then the changes appended to the
+ * journal in the meantime are copied after it, and the new file replaces
+ * the journal.  We write one each time the image is replaced, and when the
+ * changes get bigger than the last checkpoint, so that replaying them never
+ * costs much more than loading the image.
+ */
+
+// Don't bother writing a checkpoint for less changes than this.
+static const long JOURNAL_MIN_SIZE = 1 << 20;
+
+static struct {
+    journal_t       *journal;
+    FILE            *lock;      // Held while we have a journal.
+    const image_t   *image;     // Image using the journal.
+    pthread_t       thread;
+    bool            running;
+    int             done;       // Set by the thread when finished.
+    image_t         *snapshot;
+    char            *path;      // Where the thread saves the checkpoint.
+    long            pos;        // Journal size when the snapshot was taken.
+    long            bytes;      // Size of the checkpoint, -1 on error.
+    bool            stale;      // Set if the image was replaced meanwhile.
+    long            size;       // Journal size after the last checkpoint.
+} g_journal = {};
+
+// Path of the journal files of a process: name has to be "journal",
+// "checkpoint" or "recovered", and ext "gox" or "lock".
+static char *get_journal_path(const char *name, int pid, const char *ext)
+{
+    char *path;
+    asprintf(&path, "%s/%s-%d.%s", sys_get_data_dir(), name, pid, ext);
+    return path;
+}
+
+static void *journal_thread_func(void *arg)
+{
+    save_state_t *state = NULL;
+    g_journal.bytes = save_image(g_journal.snapshot, g_journal.path, &state);
+    save_state_delete(state);
+    __atomic_store_n(&g_journal.done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void journal_iter(goxel_t *goxel)
+{
+    image_t *img = goxel->image;
+    char *path;
+    long size;
+
+    if (g_journal.running && __atomic_load_n(&g_journal.done,
+                                             __ATOMIC_ACQUIRE)) {
+        pthread_join(g_journal.thread, NULL);
+        g_journal.running = false;
+        image_delete(g_journal.snapshot);
+        g_journal.snapshot = NULL;
+        if (g_journal.stale || g_journal.bytes < 0) {
+            remove(g_journal.path);
+        } else if (journal_checkpoint(g_journal.journal, g_journal.path,
+                                      g_journal.pos) == 0) {
+            g_journal.size = journal_get_size(g_journal.journal);
+            LOG_D("Journal checkpoint: %ld bytes", g_journal.bytes);
+        }
+    }
+
+    // Start a new journal when the image is replaced.
+    if (img != g_journal.image) {
+        g_journal.image = img;
+        g_journal.stale = g_journal.running;
+        journal_delete(g_journal.journal);
+        g_journal.journal = img->journal = NULL;
+        g_journal.size = 0;
+        if (!g_journal.lock) {
+            path = get_journal_path("journal", sys_get_pid(), "lock");
+            create_dirs(path);
+            g_journal.lock = sys_lock_file(path);
+            if (!g_journal.lock) LOG_E("Cannot lock %s", path);
+            free(path);
+        }
+        if (g_journal.lock) {
+            path = get_journal_path("journal", sys_get_pid(), "gox");
+            g_journal.journal = img->journal = journal_new(path);
+            free(path);
+        }
+    }
+
+    if (!g_journal.journal || g_journal.running) return;
+    // Wait for all the changes to be written, so that the snapshot matches
+    // the end of the journal file.
+    if (journal_get_pending(g_journal.journal)) return;
+    size = journal_get_size(g_journal.journal);
+    if (g_journal.size &&
+            size - g_journal.size <= max(g_journal.size, JOURNAL_MIN_SIZE))
+        return;
+
+    if (!g_journal.path)
+        g_journal.path = get_journal_path("checkpoint", sys_get_pid(), "gox");
+    g_journal.snapshot = image_copy(img->history_base);
+    g_journal.pos = size;
+    g_journal.stale = false;
+    g_journal.done = 0;
+    g_journal.running = true;
+    if (pthread_create(&g_journal.thread, NULL, journal_thread_func,
+                       NULL) != 0) {
+        LOG_E("Cannot start journal thread");
+        g_journal.running = false;
+        image_delete(g_journal.snapshot);
+        g_journal.snapshot = NULL;
+    }
+}
+
+typedef struct {
+    int     pid;        // Pid of the most recent journal, 0 if none.
+    time_t  mtime;
+} recover_t;
+
+// Recover the journal of a process if it is not running anymore.
+static void recover_journal(const char *name, void *user)
+{
+    recover_t *recover = user;
+    char *path, *lock_path, *recovered, *checkpoint;
+    FILE *lock;
+    struct stat s;
+    int pid, len = 0;
+
+    if (sscanf(name, "journal-%d.gox%n", &pid, &len) != 1 ||
+            len != strlen(name))
+        return;
+    lock_path = get_journal_path("journal", pid, "lock");
+    lock = sys_lock_file(lock_path);
+    if (!lock) { // Used by a running instance.
+        free(lock_path);
+        return;
+    }
+    path = get_journal_path("journal", pid, "gox");
+    recovered = get_journal_path("recovered", pid, "gox");
+    checkpoint = get_journal_path("checkpoint", pid, "gox");
+    remove(checkpoint);
+    remove(recovered);
+    if (rename(path, recovered) == 0) {
+        LOG_W("A session did not exit properly, its state is in %s",
+              recovered);
+        if (stat(recovered, &s) == 0 &&
+                (!recover->pid || s.st_mtime >= recover->mtime)) {
+            recover->pid = pid;
+            recover->mtime = s.st_mtime;
+        }
+    }
+    fclose(lock);
+    remove(lock_path);
+    free(lock_path);
+    free(path);
+    free(recovered);
+    free(checkpoint);
+}
+
+void journal_recover(goxel_t *goxel, bool load)
+{
+    recover_t recover = {};
+    char *recovered;
+    image_t *img;
+
+    sys_list_dir(sys_get_data_dir(), recover_journal, &recover);
+    if (!load || !recover.pid) return;
+    // Load the most recent one.
+    recovered = get_journal_path("recovered", recover.pid, "gox");
+    img = load_image(recovered, goxel->core.check_crc, NULL);
+    free(recovered);
+    if (!img) return;
+    // Make sure we don't save over the recovered file by default.
+    free(img->path);
+    img->path = NULL;
+    save_state_delete(img->save_state);
+    img->save_state = NULL;
+    set_image(goxel, img);
+}
+
+void journal_release(void)
+{
+    char *path;
+    if (g_journal.running) {
+        pthread_join(g_journal.thread, NULL);
+        g_journal.running = false;
+        image_delete(g_journal.snapshot);
+        g_journal.snapshot = NULL;
+        remove(g_journal.path);
+    }
+    if (g_journal.journal) {
+        path = get_journal_path("journal", sys_get_pid(), "gox");
+        journal_delete(g_journal.journal);
+        g_journal.journal = NULL;
+        remove(path);
+        free(path);
+    }
+    // Only release the lock once the journal is gone.
+    if (g_journal.lock) {
+        path = get_journal_path("journal", sys_get_pid(), "lock");
+        fclose(g_journal.lock);
+        g_journal.lock = NULL;
+        remove(path);
+        free(path);
+    }
+}
@@ -16,11 +16,12 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
 
 shape_t shape_sphere;
 shape_t shape_cube;
 shape_t shape_cylinder;
+shape_t shape_capsule;
 
 static float sphere_func(const vec3_t *p, const vec3_t *s)
 {
@@ -43,9 +44,19 @@ static float cylinder_func(const vec3_t *p, const vec3_t *s)
 
 }
 
+// A cylinder along z with a half sphere at each end.  The box has to be
+// square on the x and y axis.
+static float capsule_func(const vec3_t *p, const vec3_t *s)
+{
+    float z = max(fabs(p->z) - (s->z - s->x), 0);
+    vec3_t pp = vec3(p->x / s->x, p->y / s->x, z / s->x);
+    return smoothstep(1 + 1 / s->x, 1 - 1 / s->x, vec3_norm2(pp));
+}
+
 void shapes_init(void)
 {
     shape_sphere.func = sphere_func;
     shape_cube.func = cube_func;
     shape_cylinder.func = cylinder_func;
+    shape_capsule.func = capsule_func;
 }
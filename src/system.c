@@ -16,7 +16,7 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
 
 void sys_log(const char *msg)
 {
@@ -60,72 +60,89 @@ char *sys_read_asset(const char *path, int *size)
     return ret;
 }
 
-GLuint sys_get_screen_framebuffer(void)
+#ifndef WIN32
+#include <dirent.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+int sys_get_nb_cpus(void)
 {
-    return 0;
+    return max(1, sysconf(_SC_NPROCESSORS_ONLN));
 }
 
-#ifndef WIN32
-#include "nfd.h"
-bool sys_save_dialog(const char *type, char **path)
+int sys_get_pid(void)
 {
-    nfdresult_t result = NFD_SaveDialog(type, NULL, path);
-    return result == NFD_OKAY;
+    return getpid();
 }
 
-bool sys_open_dialog(const char *type, char **path)
+FILE *sys_lock_file(const char *path)
 {
-    nfdresult_t result = NFD_OpenDialog(type, NULL, path);
-    return result == NFD_OKAY;
+    FILE *file = fopen(path, "ab");
+    if (!file) return NULL;
+    if (flock(fileno(file), LOCK_EX | LOCK_NB) != 0) {
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+int sys_list_dir(const char *path,
+                 void (*f)(const char *name, void *user), void *user)
+{
+    DIR *dir = opendir(path);
+    struct dirent *entry;
+    if (!dir) return -1;
+    while ((entry = readdir(dir)))
+        f(entry->d_name, user);
+    closedir(dir);
+    return 0;
 }
 #else
+#include <windows.h>
+#include <io.h>
 
-#include "Commdlg.h"
+int sys_get_nb_cpus(void)
+{
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return max(1, info.dwNumberOfProcessors);
+}
 
-bool sys_save_dialog(const char *type, char **path)
+int sys_get_pid(void)
 {
-    OPENFILENAME ofn;       // common dialog box structure
-    char szFile[260];       // buffer for file name
-
-    ZeroMemory(&ofn, sizeof(ofn));
-    ofn.lStructSize = sizeof(ofn);
-    ofn.lpstrFile = szFile;
-    ofn.lpstrFile[0] = '\0';
-    ofn.nMaxFile = sizeof(szFile);
-    ofn.lpstrFilter = type;
-    ofn.nFilterIndex = 1;
-    ofn.lpstrFileTitle = NULL;
-    ofn.nMaxFileTitle = 0;
-    ofn.lpstrInitialDir = NULL;
-    ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST;
-    if (GetSaveFileName(&ofn) == TRUE) {
-        *path = strdup(szFile);
-        return true;
-    }
-    return false;
+    return GetCurrentProcessId();
 }
 
-bool sys_open_dialog(const char *type, char **path)
+FILE *sys_lock_file(const char *path)
 {
-    OPENFILENAME ofn;       // common dialog box structure
-    char szFile[260];       // buffer for file name
-
-    ZeroMemory(&ofn, sizeof(ofn));
-    ofn.lStructSize = sizeof(ofn);
-    ofn.lpstrFile = szFile;
-    ofn.lpstrFile[0] = '\0';
-    ofn.nMaxFile = sizeof(szFile);
-    ofn.lpstrFilter = type;
-    ofn.nFilterIndex = 1;
-    ofn.lpstrFileTitle = NULL;
-    ofn.nMaxFileTitle = 0;
-    ofn.lpstrInitialDir = NULL;
-    ofn.Flags = OFN_PATHMUSTEXIST | OFN_FILEMUSTEXIST;
-    if (GetOpenFileName(&ofn) == TRUE) {
-        *path = strdup(szFile);
-        return true;
+    OVERLAPPED overlapped = {};
+    HANDLE handle;
+    FILE *file = fopen(path, "ab");
+    if (!file) return NULL;
+    handle = (HANDLE)_get_osfhandle(_fileno(file));
+    if (!LockFileEx(handle,
+                    LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY,
+                    0, 1, 0, &overlapped)) {
+        fclose(file);
+        return NULL;
     }
-    return false;
+    return file;
 }
 
+int sys_list_dir(const char *path,
+                 void (*f)(const char *name, void *user), void *user)
+{
+    WIN32_FIND_DATAA data;
+    HANDLE handle;
+    char *pattern;
+    asprintf(&pattern, "%s\\*", path);
+    handle = FindFirstFileA(pattern, &data);
+    free(pattern);
+    if (handle == INVALID_HANDLE_VALUE) return -1;
+    do {
+        f(data.cFileName, user);
+    } while (FindNextFileA(handle, &data));
+    FindClose(handle);
+    return 0;
+}
 #endif
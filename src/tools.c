@@ -112,12 +112,13 @@ static int tool_cube_iter(goxel_t *goxel, const inputs_t *inputs, int state,
         goxel->tool_start_pos = pos;
         box = get_box(&goxel->tool_start_pos, &pos, &normal, 0,
                       &goxel->plane);
-        mesh_set(&mesh, goxel->tool_origin_mesh);
-        mesh_op(mesh, &goxel->painter, &box);
+        goxel_set_preview(goxel, &goxel->painter, &box);
         render_box(&goxel->rend, &box, false, &box_color);
         if (down) {
             state = STATE_PAINT;
             goxel->painting = true;
+            mesh_op(mesh, &goxel->painter, &box);
+            goxel->tool_box = box;
         }
         else return state;
         // Fall through.
@@ -125,8 +126,10 @@ static int tool_cube_iter(goxel_t *goxel, const inputs_t *inputs, int state,
         goxel_set_help_text(goxel, "Drag.");
         box = get_box(&goxel->tool_start_pos, &pos, &normal, 0, &goxel->plane);
         render_box(&goxel->rend, &box, false, &box_color);
-        mesh_set(&mesh, goxel->tool_origin_mesh);
-        mesh_op(mesh, &goxel->painter, &box);
+        // Only apply the difference with the previous box.
+        mesh_op_update(mesh, goxel->tool_origin_mesh, &goxel->painter,
+                       &box, &goxel->tool_box);
+        goxel->tool_box = box;
         goxel_update_meshes(goxel, false);
         if (up) {
             goxel->tool_plane_hidden_restore = goxel->plane_hidden;
@@ -149,13 +152,13 @@ static int tool_cube_iter(goxel_t *goxel, const inputs_t *inputs, int state,
             box = get_box(&goxel->tool_start_pos, &pos2, &normal, 0,
                           &goxel->plane);
             render_box(&goxel->rend, &box, false, &box_color);
-            mesh_set(&mesh, goxel->tool_origin_mesh);
-            mesh_op(mesh, &goxel->painter, &box);
+            mesh_op_update(mesh, goxel->tool_origin_mesh, &goxel->painter,
+                           &box, &goxel->tool_box);
+            goxel->tool_box = box;
             goxel_update_meshes(goxel, false);
         }
         if (down) {
-            mesh_set(&mesh, goxel->tool_origin_mesh);
-            mesh_op(mesh, &goxel->painter, &box);
+            // The mesh already has the operation of the last box applied.
             goxel_update_meshes(goxel, true);
             goxel->painting = false;
             image_history_push(goxel->image);
@@ -171,32 +174,104 @@ static int tool_cube_iter(goxel_t *goxel, const inputs_t *inputs, int state,
     }
 }
 
+// Get the position of the brush under a mouse position.
+static int brush_unproject(goxel_t *goxel, const vec2_t *view_size,
+                           const vec2_t *mouse_pos,
+                           vec3_t *pos, vec3_t *normal)
+{
+    int snaped = goxel_unproject(goxel, view_size, mouse_pos, pos, normal);
+    if (!snaped) return 0;
+    if (    snaped == SNAP_MESH && goxel->painter.op == OP_ADD &&
+            !goxel->snap_offset)
+        vec3_iadd(pos, *normal);
+    if (goxel->tool == TOOL_BRUSH && goxel->snap_offset)
+        vec3_iaddk(pos, *normal, goxel->snap_offset * goxel->tool_radius);
+    pos->x = nearbyint(pos->x - 0.5) + 0.5;
+    pos->y = nearbyint(pos->y - 0.5) + 0.5;
+    pos->z = nearbyint(pos->z - 0.5) + 0.5;
+    return snaped;
+}
+
+/*
+ * Brush strokes.
+ *
+ * We follow all the mouse positions we got since the last iteration, but
+ * only paint once the brush moved by its radius from the last painted
+ * position (tool_start_pos), so that slow strokes don't apply the same
+ * operation again and again.  With the sphere shape, the segment from the
+ * last painted position is painted with a single capsule operation, so that
+ * fast strokes don't leave gaps.  The other shapes put dabs along the
+ * segment instead.
+ */
+
+// Box for the capsule shape from a to b.
+static box_t get_capsule_box(const vec3_t *a, const vec3_t *b, float r)
+{
+    const float len = vec3_dist(*a, *b);
+    box_t box;
+    if (len == 0) return get_box(a, NULL, NULL, r, NULL);
+    box = get_box(a, b, NULL, r, NULL);
+    box.d = vec3_mul(box.d, (len / 2 + r) / (len / 2));
+    return box;
+}
+
+static void brush_paint_to(goxel_t *goxel, mesh_t *mesh, const vec3_t *pos)
+{
+    painter_t painter = goxel->painter;
+    const float r = goxel->tool_radius;
+    const vec3_t start = goxel->tool_start_pos;
+    const float len = vec3_dist(start, *pos);
+    vec3_t p;
+    box_t box;
+    int i, n;
+
+    if (painter.shape == &shape_sphere) {
+        painter.shape = &shape_capsule;
+        box = get_capsule_box(&start, pos, r);
+        mesh_op(mesh, &painter, &box);
+    } else {
+        n = max(ceil(len / max(r / 2, 1.0f)), 1);
+        for (i = 1; i <= n; i++) {
+            p = vec3_mix(start, *pos, (float)i / n);
+            p.x = nearbyint(p.x - 0.5) + 0.5;
+            p.y = nearbyint(p.y - 0.5) + 0.5;
+            p.z = nearbyint(p.z - 0.5) + 0.5;
+            box = get_box(&p, NULL, NULL, r, NULL);
+            mesh_op(mesh, &painter, &box);
+        }
+    }
+    goxel->tool_start_pos = *pos;
+}
+
+// Add a position to the stroke, return true if we painted.
+static bool brush_stroke_add(goxel_t *goxel, mesh_t *mesh, const vec3_t *pos,
+                             bool force)
+{
+    const float spacing = max(goxel->tool_radius, 1.0f);
+    const float d = vec3_dist(goxel->tool_start_pos, *pos);
+    if (d == 0 || (d < spacing && !force)) return false;
+    brush_paint_to(goxel, mesh, pos);
+    return true;
+}
+
 static int tool_brush_iter(goxel_t *goxel, const inputs_t *inputs, int state,
                            const vec2_t *view_size, bool inside)
 {
     const bool down = inputs->mouse_down[0];
     const bool pressed = down && !goxel->painting;
     const bool released = !down && goxel->painting;
-    int snaped = 0;
-    vec3_t pos, normal;
+    int snaped = 0, i;
+    bool painted = false;
+    vec3_t pos, normal, p, n;
+    const vec2_t *mouse_pos;
     box_t box;
     painter_t painter2;
     mesh_t *mesh = goxel->image->active_layer->mesh;
 
     if (inside)
-        snaped = goxel_unproject(goxel, view_size, &inputs->mouse_pos,
+        snaped = brush_unproject(goxel, view_size, &inputs->mouse_pos,
                                  &pos, &normal);
     goxel_set_help_text(goxel, "Brush: use shift to draw lines");
-    if (snaped) {
-        if (    snaped == SNAP_MESH && goxel->painter.op == OP_ADD &&
-                !goxel->snap_offset)
-            vec3_iadd(&pos, normal);
-        if (goxel->tool == TOOL_BRUSH && goxel->snap_offset)
-            vec3_iaddk(&pos, normal, goxel->snap_offset * goxel->tool_radius);
-        pos.x = nearbyint(pos.x - 0.5) + 0.5;
-        pos.y = nearbyint(pos.y - 0.5) + 0.5;
-        pos.z = nearbyint(pos.z - 0.5) + 0.5;
-    }
     switch (state) {
     case STATE_IDLE:
         goxel->tool_t = 0;
@@ -217,14 +292,12 @@ static int tool_brush_iter(goxel_t *goxel, const inputs_t *inputs, int state,
         if (check_can_skip(goxel, pos, down, goxel->painter.op))
             return state;
         box = get_box(&pos, NULL, &normal, goxel->tool_radius, NULL);
-
-        mesh_set(&mesh, goxel->tool_origin_mesh);
-        mesh_op(mesh, &goxel->painter, &box);
-        goxel_update_meshes(goxel, false);
+        goxel_set_preview(goxel, &goxel->painter, &box);
 
         if (inputs->keys[KEY_SHIFT]) {
             render_line(&goxel->rend, &goxel->tool_start_pos, &pos);
             if (pressed) {
+                mesh_op(mesh, &goxel->painter, &box);
                 painter2 = goxel->painter;
                 painter2.shape = &shape_cylinder;
                 box = get_box(&goxel->tool_start_pos, &pos, &normal,
@@ -244,12 +317,37 @@ static int tool_brush_iter(goxel_t *goxel, const inputs_t *inputs, int state,
         else return state;
         // Fall through.
     case STATE_PAINT:
-        if (check_can_skip(goxel, pos, down, goxel->painter.op))
-            return state;
-        box = get_box(&pos, NULL, &normal, goxel->tool_radius, NULL);
-        mesh_op(mesh, &goxel->painter, &box);
-        goxel_update_meshes(goxel, false);
-        goxel->tool_start_pos = pos;
+        if (pressed) {
+            goxel->tool_start_pos = pos;
+            brush_paint_to(goxel, mesh, &pos);
+            painted = true;
+        }
+        for (i = 0; !pressed && i < inputs->nb_mouse_samples &&
+                    i < ARRAY_SIZE(inputs->mouse_samples); i++) {
+            mouse_pos = &inputs->mouse_samples[i];
+            if (    mouse_pos->x < 0 || mouse_pos->x >= view_size->x ||
+                    mouse_pos->y < 0 || mouse_pos->y >= view_size->y)
+                continue;
+            if (brush_unproject(goxel, view_size, mouse_pos, &p, &n))
+                painted |= brush_stroke_add(goxel, mesh, &p, false);
+        }
+        // Always end the stroke at the release position.
+        if (!pressed && snaped)
+            painted |= brush_stroke_add(goxel, mesh, &pos, released);
+        // Also update on release to remove the preview.
+        if (painted || released) goxel_update_meshes(goxel, false);
+        // Show the end of the stroke that we didn't paint yet.
+        if (    !released && snaped &&
+                !vec3_equal(pos, goxel->tool_start_pos)) {
+            painter2 = goxel->painter;
+            box = get_box(&pos, NULL, NULL, goxel->tool_radius, NULL);
+            if (painter2.shape == &shape_sphere) {
+                painter2.shape = &shape_capsule;
+                box = get_capsule_box(&goxel->tool_start_pos, &pos,
+                                      goxel->tool_radius);
+            }
+            goxel_set_preview(goxel, &painter2, &box);
+        }
         if (released) {
             image_history_push(goxel->image);
             goxel->painting = false;
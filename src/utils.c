@@ -16,13 +16,14 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
 
 #include <stdarg.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <pthread.h>
 
 #ifdef __GNUC__
 #pragma GCC diagnostic push
@@ -43,15 +44,26 @@
 #   define LOG_TIME 1
 #endif
 
-static double get_log_time()
+static double get_time(void)
 {
-    static double origin = 0;
-    double time;
     struct timeval tv;
     gettimeofday(&tv, NULL);
-    time = tv.tv_sec + (double)tv.tv_usec / (1000 * 1000);
-    if (!origin) origin = time;
-    return time - origin;
+    return tv.tv_sec + (double)tv.tv_usec / (1000 * 1000);
+}
+
+static double g_log_origin = 0;
+
+static void init_log_origin(void)
+{
+    g_log_origin = get_time();
+}
+
+// Can be called from several threads (batch conversions).
+static double get_log_time()
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, init_log_origin);
+    return get_time() - g_log_origin;
 }
 
 void dolog(int level, const char *msg,
@@ -84,107 +96,6 @@ void dolog(int level, const char *msg,
     free(full_msg);
 }
 
-static const char* get_gl_error_text(int code) {
-    switch (code) {
-    case GL_INVALID_ENUM:
-        return "GL_INVALID_ENUM";
-    case GL_INVALID_FRAMEBUFFER_OPERATION:
-        return "GL_INVALID_FRAMEBUFFER_OPERATION";
-    case GL_INVALID_VALUE:
-        return "GL_INVALID_VALUE";
-    case GL_INVALID_OPERATION:
-        return "GL_INVALID_OPERATION";
-    case GL_OUT_OF_MEMORY:
-        return "GL_OUT_OF_MEMORY";
-    default:
-        return "undefined error";
-    }
-}
-
-int check_gl_errors(const char *file, int line)
-{
-    int errors = 0;
-    while (true)
-    {
-        GLenum x = glGetError();
-        if (x == GL_NO_ERROR)
-            return errors;
-        LOG_E("%s:%d: OpenGL error: %d (%s)\n",
-            file, line, x, get_gl_error_text(x));
-        errors++;
-    }
-}
-
-static int compile_shader(int shader, const char *code, const char *include)
-{
-    int status, len;
-    char *log;
-#ifndef GLES2
-    const char *pre = "#define highp\n#define mediump\n#define lowp\n";
-#else
-    const char *pre = "";
-#endif
-    const char *sources[] = {pre, include, code};
-    glShaderSource(shader, 3, (const char**)&sources, NULL);
-    glCompileShader(shader);
-    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
-    if (status != GL_TRUE) {
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &len);
-        log = malloc(len + 1);
-        LOG_E("Compile shader error:");
-        glGetShaderInfoLog(shader, len, &len, log);
-        LOG_E("%s", log);
-        free(log);
-        assert(false);
-    }
-    return 0;
-}
-
-int create_program(const char *vertex_shader_code,
-                       const char *fragment_shader_code, const char *include)
-{
-    int vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    include = include ? : "";
-    assert(vertex_shader);
-    if (compile_shader(vertex_shader, vertex_shader_code, include))
-        return 0;
-    int fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    assert(fragment_shader);
-    if (compile_shader(fragment_shader, fragment_shader_code, include))
-        return 0;
-    int prog = glCreateProgram();
-    glAttachShader(prog, vertex_shader);
-    glAttachShader(prog, fragment_shader);
-    glLinkProgram(prog);
-    int status;
-    glGetProgramiv(prog, GL_LINK_STATUS, &status);
-    if (status != GL_TRUE) {
-        LOG_E("Link Error");
-        int len;
-        glGetProgramiv(prog, GL_INFO_LOG_LENGTH, &len);
-        char log[len];
-        glGetProgramInfoLog(prog, len, &len, log);
-        LOG_E("%s", log);
-        return 0;
-    }
-    return prog;
-}
-
-void delete_program(int prog)
-{
-    int i;
-    GLuint shaders[2];
-    GLint count;
-    if (DEBUG) {
-        GL(glGetProgramiv(prog, GL_ATTACHED_SHADERS, &count));
-        assert(count == 2);
-    }
-    GL(glGetAttachedShaders(prog, 2, NULL, shaders));
-    for (i = 0; i < 2; i++)
-        GL(glDeleteShader(shaders[i]));
-    GL(glDeleteProgram(prog));
-}
-
 static unsigned int gox__rand_seed = 1;
 unsigned int gox_rand(void)
 {
@@ -220,7 +131,7 @@ static bool path_exists(const char *path)
     return true;
 }
 
-static void create_dirs(const char *path)
+void create_dirs(const char *path)
 {
     char *slash;
     char *buff = malloc(strlen(path) + 1);
@@ -374,3 +285,142 @@ bool str_endswith(const char *str, const char *end)
     const char *start = str + strlen(str) - strlen(end);
     return strcmp(start, end) == 0;
 }
+
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+
+// MurmurHash3 x64 128 bits, from the public domain implementation of
+// Austin Appleby.
+void hash_128(const void *data, int len, uint64_t out[2])
+{
+    const uint8_t *p = data;
+    const int nblocks = len / 16;
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+    uint64_t h1 = 0, h2 = 0, k1, k2;
+    int i;
+
+    for (i = 0; i < nblocks; i++) {
+        memcpy(&k1, p + i * 16, 8);
+        memcpy(&k2, p + i * 16 + 8, 8);
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+    }
+
+    p += nblocks * 16;
+    k1 = k2 = 0;
+    for (i = len & 15; i > 8; i--)
+        k2 ^= (uint64_t)p[i - 1] << ((i - 9) * 8);
+    if (len & 15) {
+        k2 *= c2; k2 = rotl64(k2, 33); k2 *= c1; h2 ^= k2;
+    }
+    for (i = min(len & 15, 8); i > 0; i--)
+        k1 ^= (uint64_t)p[i - 1] << ((i - 1) * 8);
+    if (len & 15) {
+        k1 *= c1; k1 = rotl64(k1, 31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= len; h2 ^= len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1); h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+    out[0] = h1;
+    out[1] = h2;
+}
+
+/*
+ * CRC-32C (Castagnoli polynomial).  We use the SSE4.2 crc32 instruction
+ * when the CPU supports it, and a slicing by 8 table implementation
+ * otherwise.
+ */
+static uint32_t g_crc32c_table[8][256];
+static pthread_once_t g_crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*g_crc32c_func)(uint32_t crc, const uint8_t *p, int len);
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, int len)
+{
+    const uint32_t (*t)[256] = (const uint32_t (*)[256])g_crc32c_table;
+    uint64_t v;
+    while (len && ((uintptr_t)p & 7)) {
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        v ^= crc;
+        crc = t[7][(v >>  0) & 0xff] ^ t[6][(v >>  8) & 0xff] ^
+              t[5][(v >> 16) & 0xff] ^ t[4][(v >> 24) & 0xff] ^
+              t[3][(v >> 32) & 0xff] ^ t[2][(v >> 40) & 0xff] ^
+              t[1][(v >> 48) & 0xff] ^ t[0][(v >> 56) & 0xff];
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        crc = t[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, int len)
+{
+    uint64_t c = crc, v;
+    while (len && ((uintptr_t)p & 7)) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+        len--;
+    }
+    while (len >= 8) {
+        memcpy(&v, p, 8);
+        c = __builtin_ia32_crc32di(c, v);
+        p += 8;
+        len -= 8;
+    }
+    while (len--)
+        c = __builtin_ia32_crc32qi(c, *p++);
+    return c;
+}
+#endif
+
+static void crc32c_init(void)
+{
+    int i, k;
+    uint32_t c;
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (k = 0; k < 8; k++)
+            c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+        g_crc32c_table[0][i] = c;
+    }
+    for (i = 0; i < 256; i++) {
+        for (k = 1; k < 8; k++) {
+            c = g_crc32c_table[k - 1][i];
+            g_crc32c_table[k][i] = (c >> 8) ^ g_crc32c_table[0][c & 0xff];
+        }
+    }
+    g_crc32c_func = crc32c_sw;
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (__builtin_cpu_supports("sse4.2"))
+        g_crc32c_func = crc32c_hw;
+#endif
+}
+
+// Update a running CRC-32C with some data.  Start with crc = 0.
+uint32_t crc32c(uint32_t crc, const void *data, int len)
+{
+    pthread_once(&g_crc32c_once, crc32c_init);
+    return ~g_crc32c_func(~crc, data, len);
+}
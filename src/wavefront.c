@@ -16,211 +16,1013 @@
  * goxel.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include "goxel.h"
+#include "core.h"
+#include <pthread.h>
+
+/*
+ * The exporters stream the data to the output file block by block.  We
+ * only keep in memory the hash tables used to give an index to each unique
+ * vertex and normal.  The lines that have to come after the vertices in the
+ * file (normals and faces) are spooled into temporary files, and appended
+ * at the end.
+ */
+
+// A quad face of the mesh, in world coordinates.
+typedef struct {
+    vec3_t   pos[4];
+    vec3_t   normal[4];
+    uvec3b_t color[4];
+} face_t;
+
+// Key used to find the index of a vertex or normal.  Must be memset to
+// zero before use, since the padding is part of the key.
+typedef struct {
+    vec3_t   v;
+    vec3_t   n;
+    uvec3b_t c;
+} vertex_key_t;
+
+typedef struct {
+    UT_hash_handle  hh;
+    vertex_key_t    key;
+    int             index;
+} vertex_entry_t;
 
 typedef struct {
-    char    type[2];
-    union {
-        struct {
-            vec3_t   v;
-            uvec3b_t c;
-        };
-        vec3_t vn;
-        struct {
-            int  vs[4];
-            int vns[4];
-        };
-    };
-} line_t;
-
-static UT_icd line_icd = {sizeof(line_t), NULL, NULL, NULL};
-
-static int lines_find(UT_array *lines, const line_t *line)
-{
-    int i, ret = 0;
-    line_t *l;
-    for (i = 0; i < utarray_len(lines); i++) {
-        l = (line_t*)utarray_eltptr(lines, i);
-        if (strncmp(l->type, line->type, 2) != 0) continue;
-        ret++;
-        if (memcmp(l, line, sizeof(*line)) == 0)
-            return ret;
-    }
-    return 0;
-}
-
-static int lines_add(UT_array *lines, const line_t *line)
+    vertex_entry_t  *table;
+    int             count;
+} vertex_index_t;
+
+// Return the index (starting at 1) of a vertex, adding it if needed.
+// The normal and color are optional.
+static int vertex_index_get(vertex_index_t *index, const vec3_t *v,
+                            const vec3_t *n, const uvec3b_t *c, bool *added)
+{
+    vertex_key_t key;
+    vertex_entry_t *entry;
+    memset(&key, 0, sizeof(key));
+    key.v = *v;
+    if (n) key.n = *n;
+    if (c) key.c = *c;
+    HASH_FIND(hh, index->table, &key, sizeof(key), entry);
+    *added = !entry;
+    if (entry) return entry->index;
+    entry = calloc(1, sizeof(*entry));
+    entry->key = key;
+    entry->index = ++index->count;
+    HASH_ADD(hh, index->table, key, sizeof(entry->key), entry);
+    return entry->index;
+}
+
+static void vertex_index_release(vertex_index_t *index)
+{
+    vertex_entry_t *entry, *tmp;
+    HASH_ITER(hh, index->table, entry, tmp) {
+        HASH_DEL(index->table, entry);
+        free(entry);
+    }
+}
+
+/*
+ * Greedy meshing: merge the adjacent coplanar faces of a block that have
+ * the same color into bigger rectangles.  This works in place on the
+ * output of block_generate_vertices, and returns the new number of faces.
+ * grid is a work buffer of 6 * N^3 ints, that should be set to zero, and
+ * is left to zero.
+ *
+ * The merged faces create T-junctions with the neighbor faces, that is
+ * fine for flat shaded models.
+ */
+static int merge_faces(voxel_vertex_t *verts, int nb, int *grid)
 {
+    const int N = BLOCK_SIZE;
+    int i, j, k, f, a, u, v, w, h, c[3], p[3], nb_out = 0;
+    voxel_vertex_t quad[4];
+
+#define CELL(f, c, a, u, v, du, dv) \
+    grid[(((f) * N + (c)[a]) * N + (c)[u] + (du)) * N + (c)[v] + (dv)]
+#define SAME(k, i) ((k) && memcmp(&verts[((k) - 1) * 4].color, \
+                                  &verts[(i) * 4].color, 4) == 0)
+
+    // Decode the voxel position and face packed in pos_data.
+    for (i = 0; i < nb; i++) {
+        c[0] = verts[i * 4].pos_data.x >> 4;
+        c[1] = verts[i * 4].pos_data.x & 15;
+        c[2] = verts[i * 4].pos_data.y >> 4;
+        f = verts[i * 4].pos_data.y & 7;
+        a = verts[i * 4].normal.x ? 0 : verts[i * 4].normal.y ? 1 : 2;
+        CELL(f, c, a, (a + 1) % 3, (a + 2) % 3, 0, 0) = i + 1;
+    }
+    for (i = 0; i < nb; i++) {
+        c[0] = verts[i * 4].pos_data.x >> 4;
+        c[1] = verts[i * 4].pos_data.x & 15;
+        c[2] = verts[i * 4].pos_data.y >> 4;
+        f = verts[i * 4].pos_data.y & 7;
+        a = verts[i * 4].normal.x ? 0 : verts[i * 4].normal.y ? 1 : 2;
+        u = (a + 1) % 3;
+        v = (a + 2) % 3;
+        if (!CELL(f, c, a, u, v, 0, 0)) continue; // Already merged.
+        for (w = 1; c[u] + w < N; w++)
+            if (!SAME(CELL(f, c, a, u, v, w, 0), i)) break;
+        for (h = 1; c[v] + h < N; h++) {
+            for (k = 0; k < w; k++)
+                if (!SAME(CELL(f, c, a, u, v, k, h), i)) break;
+            if (k < w) break;
+        }
+        for (j = 0; j < h; j++)
+            for (k = 0; k < w; k++)
+                CELL(f, c, a, u, v, k, j) = 0;
+        // Stretch the first face, keeping the vertices order.
+        memcpy(quad, &verts[i * 4], sizeof(quad));
+        for (j = 0; j < 4; j++) {
+            p[0] = quad[j].pos.x;
+            p[1] = quad[j].pos.y;
+            p[2] = quad[j].pos.z;
+            if (p[u] > c[u]) p[u] += w - 1;
+            if (p[v] > c[v]) p[v] += h - 1;
+            quad[j].pos = vec3b(p[0], p[1], p[2]);
+        }
+        memcpy(&verts[nb_out * 4], quad, sizeof(quad));
+        nb_out++;
+    }
+#undef CELL
+#undef SAME
+    return nb_out;
+}
+
+// Fill the faces of a block, return the number of faces.
+// verts should have enough space for all the vertices of a block.  If
+// grid is set, we merge the faces with merge_faces.
+static int block_get_faces(const mesh_t *mesh, const block_t *block,
+                           voxel_vertex_t *verts, face_t *faces, int *grid)
+{
+    const int N = BLOCK_SIZE;
+    int nb_faces, i, j;
+    mat4_t mat;
+    const voxel_vertex_t *vert;
+    const block_data_t *neighbors[27];
+
+    mat = mat4_identity;
+    mat4_itranslate(&mat, block->pos.x, block->pos.y, block->pos.z);
+    mat4_itranslate(&mat, -N / 2 + 0.5, -N / 2 + 0.5, -N / 2 + 0.5);
+    mesh_get_neighbors(mesh, block, neighbors);
+    nb_faces = block_generate_vertices(neighbors, 0, verts);
+    if (grid) nb_faces = merge_faces(verts, nb_faces, grid);
+    for (i = 0; i < nb_faces; i++) {
+        for (j = 0; j < 4; j++) {
+            vert = &verts[i * 4 + j];
+            faces[i].pos[j] = mat4_mul_vec3(mat,
+                    vec3(vert->pos.x, vert->pos.y, vert->pos.z));
+            faces[i].normal[j] = vec3(vert->normal.x,
+                                      vert->normal.y,
+                                      vert->normal.z);
+            faces[i].color[j] = vert->color.rgb;
+        }
+    }
+    return nb_faces;
+}
+
+/*
+ * Smooth surface extraction with surface nets, using the voxels alpha as a
+ * density, with the surface at 127 (the threshold used for the cubes).
+ *
+ * Each cell of 2x2x2 voxels crossed by the surface gets one vertex, at the
+ * mean of the crossing points of its edges, with the normal given by the
+ * alpha gradient and the mean color of its solid voxels.  Then each pair
+ * of neighbor voxels on both sides of the surface gives a quad joining the
+ * vertices of the four cells around them.
+ *
+ * A vertex only depends on the voxels of its cell, so the cells shared by
+ * two blocks give exactly the same vertices in both, and the exporters can
+ * merge them.
+ */
+typedef struct {
+    vec3_t   pos;   // Relative to the cell first voxel.
+    vec3_t   normal;
+    uvec3b_t color;
+} smooth_vertex_t;
+
+// Size of the block padded with the one voxel shell of its neighbors.
+#define P (BLOCK_SIZE + 2)
+
+// Compute the vertex of the cell starting at the voxel i.  Return false if
+// the cell is not crossed by the surface.
+static bool get_smooth_vertex(const uvec4b_t *voxels, int i,
+                              smooth_vertex_t *out)
+{
+    const int STRIDES[3] = {1, P, P * P};
+    uvec4b_t v[8];
+    int j, k, d, mask = 0, nb = 0, nb_solid = 0, rgb[3] = {};
+    vec3_t g = vec3_zero, ofs = vec3_zero;
+    float t;
+
+    for (j = 0; j < 8; j++) {
+        v[j] = voxels[i + (j & 1) * STRIDES[0] + (j >> 1 & 1) * STRIDES[1] +
+                      (j >> 2 & 1) * STRIDES[2]];
+        if (v[j].a >= 127) mask |= 1 << j;
+    }
+    if (mask == 0 || mask == 255) return false;
+    for (j = 0; j < 8; j++) {
+        for (k = 0; k < 3; k++) {
+            g.v[k] += (j >> k & 1) ? v[j].a : -v[j].a;
+            // Crossing point of the edge from corner j along k.
+            d = j | 1 << k;
+            if (d == j || !(mask >> j & 1) == !(mask >> d & 1)) continue;
+            t = (127.0 - v[j].a) / (v[d].a - v[j].a);
+            vec3_iadd(&ofs, vec3(j & 1, j >> 1 & 1, j >> 2 & 1));
+            ofs.v[k] += t;
+            nb++;
+        }
+        if (!(mask >> j & 1)) continue;
+        for (k = 0; k < 3; k++) rgb[k] += v[j].v[k];
+        nb_solid++;
+    }
+    out->pos = vec3_mul(ofs, 1.0 / nb);
+    // The gradient can be null for some symmetric cells.
+    if (vec3_norm2(g) == 0) g = vec3(0, 0, -1);
+    out->normal = vec3_normalized(vec3_neg(g));
+    out->color = uvec3b(rgb[0] / nb_solid, rgb[1] / nb_solid,
+                        rgb[2] / nb_solid);
+    return true;
+}
+
+// Orientation of the triangle a, b, c relative to a normal.
+static float triangle_orientation(const face_t *face, int a, int b, int c,
+                                  const vec3_t *n)
+{
+    vec3_t u = vec3_sub(face->pos[b], face->pos[a]);
+    vec3_t v = vec3_sub(face->pos[c], face->pos[a]);
+    return vec3_dot(vec3_cross(u, v), *n);
+}
+
+// The exporters split the quads along the 0-2 diagonal.  Since the smooth
+// quads are not planar, rotate the vertices if the other diagonal gives
+// triangles closer to the vertices normals.
+static void smooth_face_fix_diagonal(face_t *face)
+{
+    face_t tmp;
     int i;
-    i = lines_find(lines, line);
-    if (i) return i;
-    utarray_push_back(lines, line);
-    return lines_find(lines, line);
+    vec3_t n = vec3_zero;
+    for (i = 0; i < 4; i++) vec3_iadd(&n, face->normal[i]);
+    if (min(triangle_orientation(face, 0, 1, 2, &n),
+            triangle_orientation(face, 2, 3, 0, &n)) >=
+        min(triangle_orientation(face, 1, 2, 3, &n),
+            triangle_orientation(face, 3, 0, 1, &n)))
+        return;
+    tmp = *face;
+    for (i = 0; i < 4; i++) {
+        face->pos[i] = tmp.pos[(i + 1) % 4];
+        face->normal[i] = tmp.normal[(i + 1) % 4];
+        face->color[i] = tmp.color[(i + 1) % 4];
+    }
 }
 
-static int lines_count(UT_array *lines, const char *type)
+// Fill the smooth faces of a block, return the number of faces.  voxels
+// and cells are work buffers of P^3 elements.
+static int block_get_smooth_faces(const mesh_t *mesh, const block_t *block,
+                                  uvec4b_t *voxels, smooth_vertex_t *cells,
+                                  face_t *faces)
 {
-    line_t *line = NULL;
-    int ret = 0;
-    while( (line = (line_t*)utarray_next(lines, line))) {
-        if (strncmp(line->type, type, 2) == 0)
-            ret++;
+    const int N = BLOCK_SIZE;
+    const int STRIDES[3] = {1, P, P * P};
+    const block_data_t *neighbors[27];
+    int a, u, w, i, j, k, c, nb = 0, p[3], start[3], cs[4];
+    bool solid;
+    vec3_t base;
+
+    mesh_get_neighbors(mesh, block, neighbors);
+    block_get_padded_voxels(neighbors, voxels);
+    for (p[2] = 0; p[2] < P - 1; p[2]++)
+    for (p[1] = 0; p[1] < P - 1; p[1]++)
+    for (p[0] = 0; p[0] < P - 1; p[0]++) {
+        i = p[0] + p[1] * P + p[2] * P * P;
+        if (!get_smooth_vertex(voxels, i, &cells[i]))
+            cells[i].normal = vec3_zero;
     }
-    return ret;
+    // Padded voxel (1, 1, 1) is at the block first voxel.  Like the cubes
+    // faces, the voxel centers are at half integer positions.
+    base = vec3(block->pos.x - N / 2, block->pos.y - N / 2,
+                block->pos.z - N / 2);
+
+    // We do all the voxel pairs starting in the block.  The pairs coming
+    // from the blocks before are done by them, except if they don't exist.
+    start[0] = neighbors[12] ? 1 : 0;
+    start[1] = neighbors[10] ? 1 : 0;
+    start[2] = neighbors[4] ? 1 : 0;
+    for (a = 0; a < 3; a++) {
+        u = (a + 1) % 3;
+        w = (a + 2) % 3;
+        for (p[2] = a == 2 ? start[2] : 1; p[2] <= N; p[2]++)
+        for (p[1] = a == 1 ? start[1] : 1; p[1] <= N; p[1]++)
+        for (p[0] = a == 0 ? start[0] : 1; p[0] <= N; p[0]++) {
+            i = p[0] + p[1] * P + p[2] * P * P;
+            solid = voxels[i].a >= 127;
+            if (solid == (voxels[i + STRIDES[a]].a >= 127)) continue;
+            // The four cells around the pair, counter clockwise around the
+            // axis, so that the face points toward the empty voxel.
+            cs[0] = i;
+            cs[1] = i - STRIDES[u];
+            cs[2] = i - STRIDES[u] - STRIDES[w];
+            cs[3] = i - STRIDES[w];
+            if (!solid) SWAP(cs[1], cs[3]);
+            for (j = 0; j < 4; j++) {
+                c = cs[j];
+                assert(vec3_norm2(cells[c].normal) > 0);
+                faces[nb].pos[j] = vec3(base.x + c % P, base.y + c / P % P,
+                                        base.z + c / (P * P));
+                for (k = 0; k < 3; k++)
+                    faces[nb].pos[j].v[k] += cells[c].pos.v[k];
+                faces[nb].normal[j] = cells[c].normal;
+                faces[nb].color[j] = cells[c].color;
+            }
+            smooth_face_fix_diagonal(&faces[nb]);
+            nb++;
+        }
+    }
+    return nb;
+}
+
+#undef P
+
+/*
+ * Parallel faces extraction.
+ *
+ * Worker threads extract the faces of the blocks ahead of the exporter into
+ * a ring of slots.  The exporter gets them back block by block, in the
+ * order of the mesh blocks list, so the output does not depend on the
+ * number of threads.  Only the meshing is done in parallel, the vertices
+ * deduplication and the writing stay on the calling thread.
+ */
+typedef struct {
+    face_t          *faces;
+    int             nb;
+    int             capacity;
+    bool            ready;
+} face_slot_t;
+
+// Work buffers used to extract the faces of a block.
+typedef struct {
+    voxel_vertex_t  *verts;
+    face_t          *faces;
+    int             *grid;
+    uvec4b_t        *voxels;
+    smooth_vertex_t *cells;
+} face_work_t;
+
+typedef struct {
+    const mesh_t    *mesh;
+    const block_t   **blocks;
+    int             nb_blocks;
+    int             mode;
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+    int             next;       // Next block to extract.
+    int             released;   // Number of blocks done by the exporter.
+    bool            holding;    // Set if the exporter has a block.
+    face_slot_t     *slots;
+    int             nb_slots;
+    pthread_t       *threads;
+    int             nb_threads;
+    face_work_t     work;       // Used when we don't have any worker.
+} face_iter_t;
+
+static void face_work_init(face_work_t *work, int mode)
+{
+    const int N = BLOCK_SIZE;
+    const int P = N + 2;
+    memset(work, 0, sizeof(*work));
+    work->faces = calloc(N * N * N * 6, sizeof(*work->faces));
+    if (mode == EXPORT_SMOOTH) {
+        work->voxels = calloc(P * P * P, sizeof(*work->voxels));
+        work->cells = calloc(P * P * P, sizeof(*work->cells));
+        return;
+    }
+    work->verts = calloc(N * N * N * 6 * 4, sizeof(*work->verts));
+    if (mode == EXPORT_CUBES_MERGED)
+        work->grid = calloc(6 * N * N * N, sizeof(*work->grid));
 }
 
-static int line_cmp_score(const line_t *line)
+static void face_work_release(face_work_t *work)
 {
-    if (line->type[0] == 'v' && line->type[1] == ' ') return 0;
-    if (line->type[0] == 'v' && line->type[1] == 'n') return 1;
-    if (line->type[0] == 'f' && line->type[1] == ' ') return 2;
-    assert(false);
-    return 0;
+    free(work->verts);
+    free(work->faces);
+    free(work->grid);
+    free(work->voxels);
+    free(work->cells);
 }
 
-static int line_cmp(const void *a_, const void *b_)
+// Extract the faces of a block into its slot.  The slot is owned by the
+// caller until it is marked ready.
+static void face_iter_extract(face_iter_t *it, int i, face_work_t *work)
 {
-    const line_t *a = a_;
-    const line_t *b = b_;
-    return sign(line_cmp_score(a) - line_cmp_score(b));
+    face_slot_t *slot = &it->slots[i % it->nb_slots];
+    int nb;
+    if (it->mode == EXPORT_SMOOTH)
+        nb = block_get_smooth_faces(it->mesh, it->blocks[i], work->voxels,
+                                    work->cells, work->faces);
+    else
+        nb = block_get_faces(it->mesh, it->blocks[i], work->verts,
+                             work->faces, work->grid);
+    if (nb > slot->capacity) {
+        slot->capacity = nb;
+        slot->faces = realloc(slot->faces, nb * sizeof(*slot->faces));
+    }
+    if (nb) memcpy(slot->faces, work->faces, nb * sizeof(*slot->faces));
+    slot->nb = nb;
 }
 
-void wavefront_export(const mesh_t *mesh, const char *path)
+static void *face_iter_worker(void *arg)
 {
-    // XXX: Merge faces that can be merged into bigger ones.
-    //      Allow to chose between quads or triangles.
-    //      Also export mlt file for the colors.
+    face_iter_t *it = arg;
+    face_work_t work;
+    int i;
+
+    face_work_init(&work, it->mode);
+    pthread_mutex_lock(&it->mutex);
+    while (true) {
+        while (it->next < it->nb_blocks &&
+               it->next >= it->released + it->nb_slots)
+            pthread_cond_wait(&it->cond, &it->mutex);
+        if (it->next >= it->nb_blocks) break;
+        i = it->next++;
+        pthread_mutex_unlock(&it->mutex);
+        face_iter_extract(it, i, &work);
+        pthread_mutex_lock(&it->mutex);
+        it->slots[i % it->nb_slots].ready = true;
+        pthread_cond_broadcast(&it->cond);
+    }
+    pthread_mutex_unlock(&it->mutex);
+    face_work_release(&work);
+    return NULL;
+}
+
+static face_iter_t *face_iter_new(const mesh_t *mesh, int mode)
+{
+    face_iter_t *it = calloc(1, sizeof(*it));
     block_t *block;
-    voxel_vertex_t* verts;
-    vec3_t v;
-    int nb_quads, i, j;
-    mat4_t mat;
+    int i;
+
+    it->mesh = mesh;
+    DL_FOREACH(mesh->blocks, block) it->nb_blocks++;
+    it->blocks = calloc(it->nb_blocks, sizeof(*it->blocks));
+    i = 0;
+    DL_FOREACH(mesh->blocks, block) it->blocks[i++] = block;
+    it->mode = mode;
+    // By default one worker per cpu, the calling thread doing the rest.
+    it->nb_threads = core()->nb_threads ?: sys_get_nb_cpus() - 1;
+    it->nb_threads = clamp(it->nb_threads, 0, 64);
+    it->nb_slots = max(it->nb_threads * 4, 1);
+    it->slots = calloc(it->nb_slots, sizeof(*it->slots));
+    it->threads = calloc(it->nb_threads, sizeof(*it->threads));
+    pthread_mutex_init(&it->mutex, NULL);
+    pthread_cond_init(&it->cond, NULL);
+    for (i = 0; i < it->nb_threads; i++) {
+        if (pthread_create(&it->threads[i], NULL, face_iter_worker, it)) {
+            LOG_E("Cannot create export thread");
+            break;
+        }
+    }
+    it->nb_threads = i;
+    if (!it->nb_threads) face_work_init(&it->work, mode);
+    return it;
+}
+
+// Get the faces of the next block.  Return -1 once all the blocks have been
+// done.  The faces are valid until the next call.
+static int face_iter_next(face_iter_t *it, const face_t **faces)
+{
+    face_slot_t *slot;
+    int ret = -1;
+    pthread_mutex_lock(&it->mutex);
+    // Release the previous block.
+    if (it->holding) {
+        it->slots[it->released % it->nb_slots].ready = false;
+        it->released++;
+        it->holding = false;
+        pthread_cond_broadcast(&it->cond);
+    }
+    if (it->released < it->nb_blocks) {
+        slot = &it->slots[it->released % it->nb_slots];
+        // Without any worker, we extract the faces ourself.
+        if (!it->nb_threads) {
+            face_iter_extract(it, it->released, &it->work);
+            slot->ready = true;
+        }
+        while (!slot->ready)
+            pthread_cond_wait(&it->cond, &it->mutex);
+        *faces = slot->faces;
+        ret = slot->nb;
+        it->holding = true;
+    }
+    pthread_mutex_unlock(&it->mutex);
+    return ret;
+}
+
+static void face_iter_delete(face_iter_t *it)
+{
+    int i;
+    pthread_mutex_lock(&it->mutex);
+    it->next = it->nb_blocks; // Stop the workers.
+    pthread_cond_broadcast(&it->cond);
+    pthread_mutex_unlock(&it->mutex);
+    for (i = 0; i < it->nb_threads; i++)
+        pthread_join(it->threads[i], NULL);
+    for (i = 0; i < it->nb_slots; i++)
+        free(it->slots[i].faces);
+    if (!it->nb_threads) face_work_release(&it->work);
+    pthread_mutex_destroy(&it->mutex);
+    pthread_cond_destroy(&it->cond);
+    free(it->slots);
+    free(it->threads);
+    free(it->blocks);
+    free(it);
+}
+
+// Simple growing buffer.
+typedef struct {
+    uint8_t *data;
+    int     size;
+    int     capacity;
+} buffer_t;
+
+static void *buffer_add(buffer_t *buf, int size)
+{
+    void *ret;
+    if (buf->size + size > buf->capacity) {
+        buf->capacity = max(buf->capacity * 2, buf->size + size);
+        buf->data = realloc(buf->data, buf->capacity);
+    }
+    ret = buf->data + buf->size;
+    memset(ret, 0, size);
+    buf->size += size;
+    return ret;
+}
+
+// Append the content of a spool file to the output, and close it.
+// Return -1 if the spool file could not be written or read back.
+static int spool_append(FILE *out, FILE *spool)
+{
+    char buf[4096];
+    size_t n;
+    int ret;
+    rewind(spool);
+    while ((n = fread(buf, 1, sizeof(buf), spool)))
+        fwrite(buf, 1, n, out);
+    ret = ferror(spool) ? -1 : 0;
+    fclose(spool);
+    return ret;
+}
+
+// Close an export output file, return -1 if any write failed, so that the
+// batch conversions can report it (disk full...).
+static int close_output(FILE *out, const char *path, int ret)
+{
+    if (ferror(out)) ret = -1;
+    if (fclose(out) != 0) ret = -1;
+    if (ret) LOG_E("Error while writing %s", path);
+    return ret;
+}
+
+/*
+ * Palette texture: with the texture option, each color used by the faces
+ * gets one texel of a texture written next to the obj file, with a mtl
+ * file using it.  All the faces use a single material, and the uv of their
+ * color texel center, so the vertices positions are shared between the
+ * faces of different colors.
+ */
+#define PALETTE_TEXTURE_WIDTH 16
+
+// Write the palette texture and the mtl file.  base is the path of the
+// obj file without the extension.
+static int write_palette_texture(const char *base, const uvec3b_t *colors,
+                                 int nb)
+{
+    const int w = PALETTE_TEXTURE_WIDTH;
+    int h = 1, i;
+    uint8_t *img;
+    char *path;
+    const char *name;
     FILE *out;
-    const int N = BLOCK_SIZE;
-    UT_array *lines;
-    line_t line, face, *line_ptr;
-
-    utarray_new(lines, &line_icd);
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    face = (line_t){"f "};
-    DL_FOREACH(mesh->blocks, block) {
-        mat = mat4_identity;
-        mat4_itranslate(&mat, block->pos.x, block->pos.y, block->pos.z);
-        mat4_itranslate(&mat, -N / 2 + 0.5, -N / 2 + 0.5, -N / 2 + 0.5);
-
-        nb_quads = block_generate_vertices(block->data, 0, verts);
-        for (i = 0; i < nb_quads; i++) {
-            // Put the vertices.
+    int ret;
+
+    while (h * w < nb) h *= 2;
+    img = calloc(w * h, 3);
+    for (i = 0; i < nb; i++)
+        memcpy(img + i * 3, colors[i].v, 3);
+    asprintf(&path, "%s.png", base);
+    img_write(img, w, h, 3, path);
+    free(img);
+    free(path);
+
+    name = strrchr(base, '/') ? strrchr(base, '/') + 1 : base;
+    asprintf(&path, "%s.mtl", base);
+    out = fopen(path, "w");
+    if (!out) {
+        LOG_E("Cannot export to %s", path);
+        free(path);
+        return -1;
+    }
+    fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
+    fprintf(out, "newmtl palette\n");
+    fprintf(out, "Ka 0 0 0\n");
+    fprintf(out, "Kd 1 1 1\n");
+    fprintf(out, "Ks 0 0 0\n");
+    fprintf(out, "map_Kd %s.png\n", name);
+    ret = close_output(out, path, 0);
+    free(path);
+    return ret;
+}
+
+int wavefront_export(const mesh_t *mesh, const char *path, int mode,
+                     bool texture)
+{
+    // XXX: Allow to chose between quads or triangles.
+    face_iter_t *iter;
+    const face_t *faces = NULL;
+    int nb_faces, i, j, vs[4], vns[4], vts[4], h, ret = 0;
+    bool added;
+    FILE *out, *normals_file, *faces_file;
+    vertex_index_t vertices = {}, normals = {}, colors = {};
+    buffer_t palette = {};
+    char *base = NULL;
+    const char *name;
+
+    out = fopen(path, "w");
+    normals_file = tmpfile();
+    faces_file = tmpfile();
+    if (!out || !normals_file || !faces_file) {
+        LOG_E("Cannot export to %s", path);
+        if (out) fclose(out);
+        if (normals_file) fclose(normals_file);
+        if (faces_file) fclose(faces_file);
+        return -1;
+    }
+    fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
+    if (texture) {
+        i = strlen(path) - (str_endswith(path, ".obj") ? 4 : 0);
+        asprintf(&base, "%.*s", i, path);
+        name = strrchr(base, '/') ? strrchr(base, '/') + 1 : base;
+        fprintf(out, "mtllib %s.mtl\n", name);
+        fprintf(faces_file, "usemtl palette\n");
+    }
+    iter = face_iter_new(mesh, mode);
+    while ((nb_faces = face_iter_next(iter, &faces)) >= 0) {
+        for (i = 0; i < nb_faces; i++) {
             for (j = 0; j < 4; j++) {
-                v = vec3(verts[i * 4 + j].pos.x,
-                         verts[i * 4 + j].pos.y,
-                         verts[i * 4 + j].pos.z);
-                v = mat4_mul_vec3(mat, v);
-                line = (line_t){"v ", .v = v};
-                face.vs[j] = lines_add(lines, &line);
+                vs[j] = vertex_index_get(&vertices, &faces[i].pos[j],
+                                         NULL, NULL, &added);
+                if (added)
+                    fprintf(out, "v %g %g %g\n",
+                            VEC3_SPLIT(faces[i].pos[j]));
             }
-            // Put the normals
             for (j = 0; j < 4; j++) {
-                v = vec3(verts[i * 4 + j].normal.x,
-                         verts[i * 4 + j].normal.y,
-                         verts[i * 4 + j].normal.z);
-                line = (line_t){"vn", .vn = v};
-                face.vns[j] = lines_add(lines, &line);
+                vns[j] = vertex_index_get(&normals, &faces[i].normal[j],
+                                          NULL, NULL, &added);
+                if (added)
+                    fprintf(normals_file, "vn %g %g %g\n",
+                            VEC3_SPLIT(faces[i].normal[j]));
+            }
+            if (!texture) {
+                fprintf(faces_file, "f %d//%d %d//%d %d//%d %d//%d\n",
+                        vs[0], vns[0], vs[1], vns[1],
+                        vs[2], vns[2], vs[3], vns[3]);
+                continue;
             }
-            lines_add(lines, &face);
+            for (j = 0; j < 4; j++) {
+                vts[j] = vertex_index_get(&colors, &vec3_zero, NULL,
+                                          &faces[i].color[j], &added);
+                if (added)
+                    memcpy(buffer_add(&palette, sizeof(uvec3b_t)),
+                           &faces[i].color[j], sizeof(uvec3b_t));
+            }
+            fprintf(faces_file, "f %d/%d/%d %d/%d/%d %d/%d/%d %d/%d/%d\n",
+                    vs[0], vts[0], vns[0], vs[1], vts[1], vns[1],
+                    vs[2], vts[2], vns[2], vs[3], vts[3], vns[3]);
         }
     }
-    utarray_sort(lines, line_cmp);
-    out = fopen(path, "w");
-    fprintf(out, "# Goxel " GOXEL_VERSION_STR "\n");
-    line_ptr = NULL;
-    while( (line_ptr = (line_t*)utarray_next(lines, line_ptr))) {
-        if (strncmp(line_ptr->type, "v ", 2) == 0)
-            fprintf(out, "v %g %g %g\n", VEC3_SPLIT(line_ptr->v));
-        if (strncmp(line_ptr->type, "vn", 2) == 0)
-            fprintf(out, "vn %g %g %g\n", VEC3_SPLIT(line_ptr->vn));
-        if (strncmp(line_ptr->type, "f ", 2) == 0)
-            fprintf(out, "f %d//%d %d//%d %d//%d %d//%d\n",
-                         line_ptr->vs[0], line_ptr->vns[0],
-                         line_ptr->vs[1], line_ptr->vns[1],
-                         line_ptr->vs[2], line_ptr->vns[2],
-                         line_ptr->vs[3], line_ptr->vns[3]);
+    // The uv are only known once we have all the colors.
+    if (texture) {
+        for (h = 1; h * PALETTE_TEXTURE_WIDTH < colors.count; h *= 2);
+        for (i = 0; i < colors.count; i++) {
+            fprintf(out, "vt %g %g\n",
+                    (i % PALETTE_TEXTURE_WIDTH + 0.5) / PALETTE_TEXTURE_WIDTH,
+                    1.0 - (i / PALETTE_TEXTURE_WIDTH + 0.5) / h);
+        }
+        ret |= write_palette_texture(base, (uvec3b_t*)palette.data,
+                                     colors.count);
     }
-    fclose(out);
-    utarray_free(lines);
+    ret |= spool_append(out, normals_file);
+    ret |= spool_append(out, faces_file);
+    ret = close_output(out, path, ret);
+    face_iter_delete(iter);
+    vertex_index_release(&vertices);
+    vertex_index_release(&normals);
+    vertex_index_release(&colors);
+    free(palette.data);
+    free(base);
+    return ret;
 }
 
-void ply_export(const mesh_t *mesh, const char *path)
+int ply_export(const mesh_t *mesh, const char *path, bool ascii, int mode)
 {
-    block_t *block;
-    voxel_vertex_t* verts;
-    vec3_t v;
-    uvec3b_t c;
-    int nb_quads, i, j;
-    mat4_t mat;
-    FILE *out;
-    const int N = BLOCK_SIZE;
-    UT_array *lines;
-    line_t line, face, *line_ptr;
-
-    utarray_new(lines, &line_icd);
-    verts = calloc(N * N * N * 6 * 4, sizeof(*verts));
-    face = (line_t){"f "};
-    DL_FOREACH(mesh->blocks, block) {
-        mat = mat4_identity;
-        mat4_itranslate(&mat, block->pos.x, block->pos.y, block->pos.z);
-        mat4_itranslate(&mat, -N / 2 + 0.5, -N / 2 + 0.5, -N / 2 + 0.5);
-
-        nb_quads = block_generate_vertices(block->data, 0, verts);
-        for (i = 0; i < nb_quads; i++) {
-            // Put the vertices.
+    face_iter_t *iter;
+    const face_t *faces = NULL;
+    int nb_faces, total_faces = 0, i, j, vs[4], ret = 0;
+    bool added;
+    FILE *out, *vertices_file, *faces_file;
+    vertex_index_t vertices = {};
+    // Binary records, packed: float x, y, z, uchar r, g, b for the
+    // vertices, and uchar 4, int indices[4] for the faces.  Like the rest
+    // of the code we assume a little endian host.
+    uint8_t vertex_data[15], face_data[17];
+
+    out = fopen(path, ascii ? "w" : "wb");
+    vertices_file = tmpfile();
+    faces_file = tmpfile();
+    if (!out || !vertices_file || !faces_file) {
+        LOG_E("Cannot export to %s", path);
+        if (out) fclose(out);
+        if (vertices_file) fclose(vertices_file);
+        if (faces_file) fclose(faces_file);
+        return -1;
+    }
+    face_data[0] = 4;
+    iter = face_iter_new(mesh, mode);
+    while ((nb_faces = face_iter_next(iter, &faces)) >= 0) {
+        for (i = 0; i < nb_faces; i++) {
             for (j = 0; j < 4; j++) {
-                v = vec3(verts[i * 4 + j].pos.x,
-                         verts[i * 4 + j].pos.y,
-                         verts[i * 4 + j].pos.z);
-                v = mat4_mul_vec3(mat, v);
-                c = verts[i * 4 + j].color.rgb;
-                line = (line_t){"v ", .v = v, .c = c};
-                face.vs[j] = lines_add(lines, &line);
+                vs[j] = vertex_index_get(&vertices, &faces[i].pos[j],
+                                         NULL, &faces[i].color[j],
+                                         &added) - 1;
+                if (!added) continue;
+                if (ascii) {
+                    fprintf(vertices_file, "%g %g %g %d %d %d\n",
+                            VEC3_SPLIT(faces[i].pos[j]),
+                            VEC3_SPLIT(faces[i].color[j]));
+                } else {
+                    memcpy(vertex_data, faces[i].pos[j].v, 12);
+                    memcpy(vertex_data + 12, faces[i].color[j].v, 3);
+                    fwrite(vertex_data, sizeof(vertex_data), 1,
+                           vertices_file);
+                }
             }
-            // Put the normals
-            for (j = 0; j < 4; j++) {
-                v = vec3(verts[i * 4 + j].normal.x,
-                         verts[i * 4 + j].normal.y,
-                         verts[i * 4 + j].normal.z);
-                line = (line_t){"vn", .vn = v};
-                face.vns[j] = lines_add(lines, &line);
+            if (ascii) {
+                fprintf(faces_file, "4 %d %d %d %d\n",
+                        vs[0], vs[1], vs[2], vs[3]);
+            } else {
+                memcpy(face_data + 1, vs, 16);
+                fwrite(face_data, sizeof(face_data), 1, faces_file);
             }
-            lines_add(lines, &face);
         }
+        total_faces += nb_faces;
     }
-    utarray_sort(lines, line_cmp);
-    out = fopen(path, "w");
     fprintf(out, "ply\n");
-    fprintf(out, "format ascii 1.0\n");
+    fprintf(out, "format %s 1.0\n", ascii ? "ascii" : "binary_little_endian");
     fprintf(out, "comment Generated from Goxel " GOXEL_VERSION_STR "\n");
-    fprintf(out, "element vertex %d\n", lines_count(lines, "v "));
+    fprintf(out, "element vertex %d\n", vertices.count);
     fprintf(out, "property float x\n");
     fprintf(out, "property float y\n");
     fprintf(out, "property float z\n");
     fprintf(out, "property uchar red\n");
     fprintf(out, "property uchar green\n");
     fprintf(out, "property uchar blue\n");
-    fprintf(out, "element face %d\n", lines_count(lines, "f "));
+    fprintf(out, "element face %d\n", total_faces);
     fprintf(out, "property list uchar int vertex_index\n");
     fprintf(out, "end_header\n");
-    line_ptr = NULL;
-    while( (line_ptr = (line_t*)utarray_next(lines, line_ptr))) {
-        if (strncmp(line_ptr->type, "v ", 2) == 0)
-            fprintf(out, "%g %g %g %d %d %d\n",
-                    VEC3_SPLIT(line_ptr->v),
-                    VEC3_SPLIT(line_ptr->c));
-        if (strncmp(line_ptr->type, "f ", 2) == 0)
-            fprintf(out, "4 %d %d %d %d\n", line_ptr->vs[0] - 1,
-                                            line_ptr->vs[1] - 1,
-                                            line_ptr->vs[2] - 1,
-                                            line_ptr->vs[3] - 1);
-    }
-    fclose(out);
-    utarray_free(lines);
+    ret |= spool_append(out, vertices_file);
+    ret |= spool_append(out, faces_file);
+    ret = close_output(out, path, ret);
+    face_iter_delete(iter);
+    vertex_index_release(&vertices);
+    return ret;
+}
+
+/*
+ * Binary STL:
+ *  80 bytes header
+ *  4 bytes number of triangles
+ *  For each triangle (50 bytes):
+ *      float[3] normal
+ *      float[3] x 3 vertices
+ *      2 bytes attribute (0)
+ *
+ * There is no vertex sharing in STL, so we can write the triangles
+ * directly, and patch the count at the end.  STL has no standard way to
+ * store colors, so we only export the geometry.
+ */
+int stl_export(const mesh_t *mesh, const char *path, int mode)
+{
+    face_iter_t *iter;
+    const face_t *faces = NULL;
+    int nb_faces, i, j, k;
+    uint32_t nb_triangles = 0;
+    FILE *out;
+    const int TRIANGLES[2][3] = {{0, 1, 2}, {2, 3, 0}};
+    char header[80] = "Generated from Goxel " GOXEL_VERSION_STR;
+    uint8_t data[50] = {};
+
+    out = fopen(path, "wb");
+    if (!out) {
+        LOG_E("Cannot export to %s", path);
+        return -1;
+    }
+    fwrite(header, sizeof(header), 1, out);
+    fwrite(&nb_triangles, 4, 1, out); // Patched at the end.
+    iter = face_iter_new(mesh, mode);
+    while ((nb_faces = face_iter_next(iter, &faces)) >= 0) {
+        for (i = 0; i < nb_faces; i++) {
+            for (k = 0; k < 2; k++) {
+                memcpy(data, faces[i].normal[0].v, 12);
+                for (j = 0; j < 3; j++)
+                    memcpy(data + 12 + j * 12,
+                           faces[i].pos[TRIANGLES[k][j]].v, 12);
+                fwrite(data, sizeof(data), 1, out);
+            }
+        }
+        nb_triangles += nb_faces * 2;
+    }
+    fseek(out, 80, SEEK_SET);
+    fwrite(&nb_triangles, 4, 1, out);
+    face_iter_delete(iter);
+    return close_output(out, path, 0);
+}
+
+/*
+ * GLB (binary glTF 2.0) export.
+ *
+ * We write a single indexed triangles primitive.  The positions are
+ * quantized using KHR_mesh_quantization: all the vertices are at half
+ * integer coordinates, so we store them as SHORT with a 0.5 translation on
+ * the node (unless the model is too big for that, or for the smooth
+ * surfaces, in which case we use floats).  Normals are stored as
+ * normalized BYTE and colors as normalized UNSIGNED_BYTE, each element
+ * padded to 4 bytes as required by the spec.
+ */
+
+int gltf_export(const mesh_t *mesh, const char *path, int mode)
+{
+    face_iter_t *iter;
+    const face_t *faces = NULL;
+    int nb_faces, i, j, k, vs[4], nb_vertices = 0, nb_indices = 0;
+    bool added, quantize;
+    FILE *out;
+    const int TRIANGLES[6] = {0, 1, 2, 2, 3, 0};
+    vertex_index_t vertices = {};
+    buffer_t positions = {}, normals = {}, colors = {}, indices = {};
+    buffer_t bin = {};
+    vec3_t vmin = vec3(+FLT_MAX, +FLT_MAX, +FLT_MAX);
+    vec3_t vmax = vec3(-FLT_MAX, -FLT_MAX, -FLT_MAX);
+    vec3_t *pos;
+    int8_t *n;
+    uint8_t *c;
+    int16_t *q;
+    uint32_t *index32, header[5];
+    uint16_t *index16;
+    int pos_view_size, index_size, ofs[4], json_size;
+    char json[4096];
+
+    out = fopen(path, "wb");
+    if (!out) {
+        LOG_E("Cannot export to %s", path);
+        return -1;
+    }
+    iter = face_iter_new(mesh, mode);
+    while ((nb_faces = face_iter_next(iter, &faces)) >= 0) {
+        for (i = 0; i < nb_faces; i++) {
+            for (j = 0; j < 4; j++) {
+                vs[j] = vertex_index_get(&vertices, &faces[i].pos[j],
+                                         &faces[i].normal[j],
+                                         &faces[i].color[j], &added) - 1;
+                if (!added) continue;
+                pos = buffer_add(&positions, sizeof(*pos));
+                *pos = faces[i].pos[j];
+                for (k = 0; k < 3; k++) {
+                    vmin.v[k] = min(vmin.v[k], pos->v[k]);
+                    vmax.v[k] = max(vmax.v[k], pos->v[k]);
+                }
+                n = buffer_add(&normals, 4);
+                for (k = 0; k < 3; k++) n[k] = faces[i].normal[j].v[k] * 127;
+                c = buffer_add(&colors, 4);
+                memcpy(c, faces[i].color[j].v, 3);
+                nb_vertices++;
+            }
+            for (j = 0; j < 6; j++) {
+                index32 = buffer_add(&indices, 4);
+                *index32 = vs[TRIANGLES[j]];
+            }
+            nb_indices += 6;
+        }
+    }
+    face_iter_delete(iter);
+
+    // Binary buffer: positions, normals, colors, indices.
+    quantize = mode != EXPORT_SMOOTH && nb_vertices &&
+               vmin.x >= -32767 && vmin.y >= -32767 && vmin.z >= -32767 &&
+               vmax.x <= 32767 && vmax.y <= 32767 && vmax.z <= 32767;
+    ofs[0] = 0;
+    if (quantize) {
+        pos_view_size = nb_vertices * 8;
+        for (i = 0; i < nb_vertices; i++) {
+            q = buffer_add(&bin, 8);
+            pos = (vec3_t*)positions.data + i;
+            for (k = 0; k < 3; k++) q[k] = floor(pos->v[k]);
+        }
+    } else {
+        pos_view_size = nb_vertices * 12;
+        memcpy(buffer_add(&bin, positions.size), positions.data,
+               positions.size);
+    }
+    ofs[1] = bin.size;
+    memcpy(buffer_add(&bin, normals.size), normals.data, normals.size);
+    ofs[2] = bin.size;
+    memcpy(buffer_add(&bin, colors.size), colors.data, colors.size);
+    ofs[3] = bin.size;
+    // 65535 is reserved for primitive restart.
+    index_size = nb_vertices < 65535 ? 2 : 4;
+    for (i = 0; i < nb_indices; i++) {
+        if (index_size == 2) {
+            index16 = buffer_add(&bin, 2);
+            *index16 = ((uint32_t*)indices.data)[i];
+        } else {
+            index32 = buffer_add(&bin, 4);
+            *index32 = ((uint32_t*)indices.data)[i];
+        }
+    }
+    buffer_add(&bin, (4 - bin.size % 4) % 4);
+    free(positions.data);
+    free(normals.data);
+    free(colors.data);
+    free(indices.data);
+    vertex_index_release(&vertices);
+
+    if (nb_vertices) {
+        if (quantize) {
+            vmin = vec3(floor(vmin.x), floor(vmin.y), floor(vmin.z));
+            vmax = vec3(floor(vmax.x), floor(vmax.y), floor(vmax.z));
+        }
+        json_size = snprintf(json, sizeof(json),
+            "{\"asset\":{\"version\":\"2.0\","
+                "\"generator\":\"Goxel " GOXEL_VERSION_STR "\"},"
+            "\"extensionsUsed\":[\"KHR_mesh_quantization\"],"
+            "\"extensionsRequired\":[\"KHR_mesh_quantization\"],"
+            "\"scene\":0,\"scenes\":[{\"nodes\":[0]}],"
+            "\"nodes\":[{\"mesh\":0%s}],"
+            "\"meshes\":[{\"primitives\":[{\"attributes\":"
+                "{\"POSITION\":0,\"NORMAL\":1,\"COLOR_0\":2},"
+                "\"indices\":3,\"mode\":4}]}],"
+            "\"accessors\":["
+                "{\"bufferView\":0,\"componentType\":%d,\"count\":%d,"
+                    "\"type\":\"VEC3\",\"min\":[%.9g,%.9g,%.9g],"
+                    "\"max\":[%.9g,%.9g,%.9g]},"
+                "{\"bufferView\":1,\"componentType\":5120,"
+                    "\"normalized\":true,\"count\":%d,\"type\":\"VEC3\"},"
+                "{\"bufferView\":2,\"componentType\":5121,"
+                    "\"normalized\":true,\"count\":%d,\"type\":\"VEC3\"},"
+                "{\"bufferView\":3,\"componentType\":%d,\"count\":%d,"
+                    "\"type\":\"SCALAR\"}],"
+            "\"bufferViews\":["
+                "{\"buffer\":0,\"byteOffset\":%d,\"byteLength\":%d,"
+                    "\"byteStride\":%d,\"target\":34962},"
+                "{\"buffer\":0,\"byteOffset\":%d,\"byteLength\":%d,"
+                    "\"byteStride\":4,\"target\":34962},"
+                "{\"buffer\":0,\"byteOffset\":%d,\"byteLength\":%d,"
+                    "\"byteStride\":4,\"target\":34962},"
+                "{\"buffer\":0,\"byteOffset\":%d,\"byteLength\":%d,"
+                    "\"target\":34963}],"
+            "\"buffers\":[{\"byteLength\":%d}]}",
+            quantize ? ",\"translation\":[0.5,0.5,0.5]" : "",
+            quantize ? 5122 : 5126, nb_vertices,
+            VEC3_SPLIT(vmin), VEC3_SPLIT(vmax),
+            nb_vertices, nb_vertices,
+            index_size == 2 ? 5123 : 5125, nb_indices,
+            ofs[0], pos_view_size, quantize ? 8 : 12,
+            ofs[1], ofs[2] - ofs[1],
+            ofs[2], ofs[3] - ofs[2],
+            ofs[3], nb_indices * index_size,
+            bin.size);
+    } else {
+        json_size = snprintf(json, sizeof(json),
+            "{\"asset\":{\"version\":\"2.0\","
+                "\"generator\":\"Goxel " GOXEL_VERSION_STR "\"},"
+            "\"scene\":0,\"scenes\":[{\"nodes\":[]}]}");
+    }
+    assert(json_size < sizeof(json) - 4);
+    // The JSON chunk is padded with spaces.
+    while (json_size % 4) json[json_size++] = ' ';
+
+    header[0] = 0x46546C67; // "glTF"
+    header[1] = 2;
+    header[2] = 12 + 8 + json_size + (bin.size ? 8 + bin.size : 0);
+    header[3] = json_size;
+    header[4] = 0x4E4F534A; // "JSON"
+    fwrite(header, 4, 5, out);
+    fwrite(json, json_size, 1, out);
+    if (bin.size) {
+        header[0] = bin.size;
+        header[1] = 0x004E4942; // "BIN"
+        fwrite(header, 4, 2, out);
+        fwrite(bin.data, bin.size, 1, out);
+    }
+    free(bin.data);
+    return close_output(out, path, 0);
 }